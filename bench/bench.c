@@ -0,0 +1,256 @@
+// bench.c — benchmarks for mtsh (run with `make bench`)
+// Build: cc -std=c11 -Wall -Wextra -O2 -o bench/bench bench/bench.c
+// Run:   bench/bench [-o results.json] [-s scale] ./mtsh [./mtsh-fork]
+//
+// Every benchmark generates its input, runs the shell on it a few times and
+// keeps the best run, so a busy machine makes numbers worse, not random.
+// Results come out as a table on stdout and as JSON (default
+// bench/results.json), for comparing releases.
+
+// --- POSIX feature set, as in mtsh.c ---
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>      // printf(), fprintf(), fopen()
+#include <stdlib.h>     // exit(), malloc(), mkdtemp(), posix_openpt()
+#include <string.h>     // strcmp(), strstr(), memset()
+#include <unistd.h>     // read(), close(), unlink()
+#include <fcntl.h>      // open(), O_RDONLY, O_WRONLY
+#include <spawn.h>      // posix_spawn(), posix_spawn_file_actions_*()
+#include <sys/wait.h>   // waitpid()
+#include <time.h>       // clock_gettime(), CLOCK_MONOTONIC
+#include <poll.h>       // poll(), for the prompt latency
+
+extern char **environ;
+
+#define RUNS 3       // Runs per benchmark, the best one counts
+#define MAX_RESULTS 32
+
+struct result {
+    const char *name;
+    double value;
+    const char *unit;
+};
+
+static struct result results[MAX_RESULTS];
+static int nresults;
+static int scale = 1;     // -s: multiply every workload by this
+static char tmpdir[64];   // Inputs and the shell's caches go here
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void add_result(const char *name, double value, const char *unit) {
+    if (nresults == MAX_RESULTS) return;
+    results[nresults++] = (struct result){ name, value, unit };
+    printf("%-40s %14.2f  %s\n", name, value, unit);
+    fflush(stdout);
+}
+
+// ------------------ Running the shell ------------------
+// Start `argv` with stdin from `in` (NULL = /dev/null) and stdout, stderr to
+// /dev/null, and return how long it took until it exited, or -1.
+static double run_once(char *const argv[], const char *in) {
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, 0, in ? in : "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, 2, "/dev/null", O_WRONLY, 0);
+    double t0 = now();
+    pid_t pid;
+    int err = posix_spawn(&pid, argv[0], &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (err != 0) { fprintf(stderr, "bench: %s: %s\n", argv[0], strerror(err)); return -1; }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {}
+    double t = now() - t0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench: %s %s failed\n", argv[0], argv[1] ? argv[1] : "");
+        return -1;
+    }
+    return t;
+}
+
+// The best of RUNS runs, after one untimed run to warm caches (the page
+// cache, mtsh's compiled script cache and the like).
+static double run_best(char *const argv[], const char *in) {
+    if (run_once(argv, in) < 0) return -1;
+    double best = -1;
+    for (int i = 0; i < RUNS; i++) {
+        double t = run_once(argv, in);
+        if (t < 0) return -1;
+        if (best < 0 || t < best) best = t;
+    }
+    return best;
+}
+
+// Run the script at `path` with `shell`, as a script file (compiled and cached).
+static double run_script(const char *shell, const char *path) {
+    char *argv[] = { (char *)shell, (char *)path, NULL };
+    return run_best(argv, NULL);
+}
+
+// Run the lines in `path` fed through stdin: never cached, always parsed.
+static double run_stdin(const char *shell, const char *path) {
+    char *argv[] = { (char *)shell, NULL };
+    return run_best(argv, path);
+}
+
+// Write `n` copies of `line` (plus a newline) to a file in tmpdir.
+static const char *make_input(const char *name, const char *line, long n) {
+    static char path[8][128];
+    static int slot;
+    char *p = path[slot++ % 8];
+    snprintf(p, sizeof path[0], "%s/%s", tmpdir, name);
+    FILE *f = fopen(p, "w");
+    if (!f) { perror(p); exit(1); }
+    for (long i = 0; i < n; i++) fprintf(f, "%s\n", line);
+    if (fclose(f) != 0) { perror(p); exit(1); }
+    return p;
+}
+
+// ------------------ The benchmarks ------------------
+// Commands per second for `cmd`, run n times from a script.
+static void bench_commands(const char *name, const char *shell, const char *cmd, long n) {
+    const char *in = make_input("cmds.sh", cmd, n);
+    double t = run_script(shell, in);
+    if (t > 0) add_result(name, (double)n / t, "cmds/s");
+}
+
+// Tokenizer and expansion speed on long lines of words and quotes.
+static void bench_tokenizer(const char *shell) {
+    static char line[64 * 1024];
+    size_t len = 0;
+    len += (size_t)snprintf(line, sizeof line, "true");
+    while (len + 32 < sizeof line)
+        len += (size_t)snprintf(line + len, sizeof line - len, " word%zu \"a quoted one\" x=y", len);
+    long n = 200 * scale;
+    const char *in = make_input("tokens.sh", line, n);
+    double t = run_stdin(shell, in);
+    if (t > 0) add_result("tokenize+expand (64 KiB lines)", (double)(len + 1) * (double)n / t / 1e6, "MB/s");
+}
+
+// What a redirection costs a builtin and an external command.
+static void bench_redirection(const char *shell) {
+    long n = 20000 * scale;
+    double plain = run_script(shell, make_input("r1.sh", "true", n));
+    double redir = run_script(shell, make_input("r2.sh", "true > /dev/null 2>&1", n));
+    if (plain > 0 && redir > 0) add_result("redirection, builtin", (redir - plain) / (double)n * 1e6, "us/redir");
+    // An external command costs hundreds of times more than the redirection,
+    // so a difference would be noise: compare this with the posix_spawn line.
+    n = 2000 * scale;
+    redir = run_script(shell, make_input("r3.sh", "/bin/true > /dev/null 2>&1", n));
+    if (redir > 0) add_result("/bin/true > /dev/null 2>&1", (double)n / redir, "cmds/s");
+}
+
+// Bytes per second through a three-stage pipeline.
+static void bench_pipeline(const char *shell) {
+    long long bytes = 512LL * 1024 * 1024 * scale;
+    char cmd[128];
+    snprintf(cmd, sizeof cmd, "head -c %lld /dev/zero | cat | cat > /dev/null", bytes);
+    double t = run_script(shell, make_input("pipe.sh", cmd, 1));
+    if (t > 0) add_result("pipeline head | cat | cat", (double)bytes / t / 1e9, "GB/s");
+}
+
+// From exec to the first prompt on a terminal (banner included), and the
+// whole life of `mtsh -c true`.
+static void bench_startup(const char *shell) {
+    char *argv[] = { (char *)shell, "-c", "true", NULL };
+    double t = run_best(argv, NULL);
+    if (t > 0) add_result("startup, mtsh -c true", t * 1e3, "ms");
+
+    double best = -1;
+    for (int i = 0; i < RUNS + 1; i++) {
+        int m = posix_openpt(O_RDWR | O_NOCTTY);
+        if (m < 0 || grantpt(m) < 0 || unlockpt(m) < 0) { perror("bench: pty"); return; }
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init(&fa);
+        for (int fd = 0; fd < 3; fd++) posix_spawn_file_actions_addopen(&fa, fd, ptsname(m), O_RDWR, 0);
+        posix_spawn_file_actions_addclose(&fa, m);
+        char *sargv[] = { (char *)shell, NULL };
+        double t0 = now();
+        pid_t pid;
+        int err = posix_spawn(&pid, shell, &fa, NULL, sargv, environ);
+        posix_spawn_file_actions_destroy(&fa);
+        if (err != 0) { close(m); fprintf(stderr, "bench: %s: %s\n", shell, strerror(err)); return; }
+        char buf[4096];
+        size_t have = 0;
+        double t1 = -1;
+        for (;;) { // Until "> " shows up
+            struct pollfd p = { m, POLLIN, 0 };
+            if (poll(&p, 1, 5000) <= 0) break;
+            ssize_t r = read(m, buf + have, sizeof buf - 1 - have);
+            if (r <= 0) break;
+            have += (size_t)r;
+            buf[have] = '\0';
+            if (strstr(buf, "> ")) { t1 = now() - t0; break; }
+            if (have > sizeof buf / 2) { memmove(buf, buf + have - 8, 8); have = 8; }
+        }
+        ssize_t w = write(m, "\004", 1); // Ctrl-D: exit
+        (void)w;
+        int status;
+        while (waitpid(pid, &status, 0) < 0) {}
+        close(m);
+        if (t1 < 0) { fprintf(stderr, "bench: no prompt from %s\n", shell); return; }
+        if (i > 0 && (best < 0 || t1 < best)) best = t1; // The first one warms up
+    }
+    add_result("startup to first prompt (pty)", best * 1e3, "ms");
+}
+
+// ------------------ Output ------------------
+static int write_json(const char *path, const char *shell) {
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return -1; }
+    fprintf(f, "{\n  \"shell\": \"%s\",\n  \"scale\": %d,\n  \"time\": %lld,\n  \"results\": [\n",
+            shell, scale, (long long)time(NULL));
+    for (int i = 0; i < nresults; i++)
+        fprintf(f, "    { \"name\": \"%s\", \"value\": %.4f, \"unit\": \"%s\" }%s\n",
+                results[i].name, results[i].value, results[i].unit, i + 1 < nresults ? "," : "");
+    fprintf(f, "  ]\n}\n");
+    return fclose(f);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: bench [-o results.json] [-s scale] ./mtsh [./mtsh-fork]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    const char *json = "bench/results.json";
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i += 2) {
+        if (i + 1 >= argc) usage();
+        if (strcmp(argv[i], "-o") == 0) json = argv[i+1];
+        else if (strcmp(argv[i], "-s") == 0 && (scale = atoi(argv[i+1])) > 0) continue;
+        else usage();
+    }
+    if (i >= argc) usage();
+    const char *shell = argv[i], *fork_shell = i + 1 < argc ? argv[i+1] : NULL;
+
+    // Keep our inputs and the shell's caches (compiled scripts, memo, ...) apart.
+    snprintf(tmpdir, sizeof tmpdir, "/tmp/mtsh-bench-XXXXXX");
+    if (!mkdtemp(tmpdir)) { perror("bench: mkdtemp"); return 1; }
+    setenv("XDG_CACHE_HOME", tmpdir, 1);
+
+    printf("%-40s %14s  %s\n", "benchmark", "value", "unit");
+    printf("%-40s %14s  %s\n", "---------", "-----", "----");
+    bench_commands("true, builtin", shell, "true", 50000L * scale);
+    bench_commands("/bin/true, posix_spawn", shell, "/bin/true", 2000L * scale);
+    if (fork_shell) bench_commands("/bin/true, fork", fork_shell, "/bin/true", 2000L * scale);
+    bench_tokenizer(shell);
+    bench_redirection(shell);
+    bench_pipeline(shell);
+    bench_startup(shell);
+
+    int r = write_json(json, shell);
+    if (r == 0) printf("\nJSON written to %s\n", json);
+    char cmd[128];
+    snprintf(cmd, sizeof cmd, "rm -rf %s", tmpdir); // Inputs and caches
+    if (system(cmd) != 0) fprintf(stderr, "bench: could not remove %s\n", tmpdir);
+    return r == 0 ? 0 : 1;
+}
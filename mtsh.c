@@ -1,5 +1,6 @@
 // mtsh.c — Empty Shell (pronounced “em-tee-shell”)
 // Build: cc -std=c11 -Wall -Wextra -O2 -o mtsh mtsh.c
+//        (add -DMTSH_SPAWN_FORK to use fork()+execv() instead of posix_spawn())
 // Run:   ./mtsh
 
 // --- POSIX feature set ---
@@ -7,22 +8,56 @@
 // like getline(), and consistent prototypes across systems.
 // This must be defined *before* including any system headers.
 #define _POSIX_C_SOURCE 200809L
+// On Linux we additionally ask for the GNU/Linux extensions (pipe2(), splice(), ...).
+// Every use of them sits behind #ifdef __linux__ with a plain POSIX fallback.
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 
 // --- Standard / system headers ---
 #include <stdio.h>      // printf(), fprintf(), perror(), putchar()
 #include <stdlib.h>     // exit(), free(), getenv()
-#include <string.h>     // strlen(), strcmp(), strtok(), strsignal()
-#include <unistd.h>     // fork(), execvp(), chdir()
+#include <string.h>     // strlen(), strcmp(), strsignal()
+#include <unistd.h>     // fork(), execv(), chdir(), access()
 #include <sys/wait.h>   // waitpid(), WIFEXITED(), WEXITSTATUS(), WIFSIGNALED(), WTERMSIG()
 #include <errno.h>      // errno variable, error codes for perror()
 #include <fcntl.h>      // open(), O_CREAT, O_WRONLY, O_TRUNC, dup2()
+#include <spawn.h>      // posix_spawn(), posix_spawn_file_actions_*()
+#include <signal.h>     // sigaction(), SIGCHLD, SIGPIPE
+#include <sys/stat.h>   // stat(), S_ISREG()
+#include <sys/resource.h> // struct rusage, getrusage(), wait4()
+#include <time.h>       // clock_gettime(), CLOCK_MONOTONIC
+#include <stdint.h>     // uint32_t
+#include <sys/socket.h> // socket(), sendmsg(), recvmsg(), SCM_RIGHTS
+#include <sys/un.h>     // struct sockaddr_un
+#include <dirent.h>     // opendir(), readdir(), DT_DIR
+#include <sys/mman.h>   // mmap(), munmap()
+#include <sys/uio.h>    // writev()
+#include <termios.h>    // tcgetattr(), tcsetattr(): raw mode for line editing
+#include <poll.h>       // poll(), ppoll(): waiting with a deadline, see `timeout`
+#include <limits.h>     // PIPE_BUF
+#include <pthread.h>    // pthread_create(): builtin pipeline stages on threads
+#ifdef __linux__
+#include <sched.h>       // CLONE_PARENT
+#include <sys/syscall.h> // SYS_clone, SYS_getdents64
+#include <sys/sendfile.h> // sendfile()
+#endif
+
+extern char **environ;  // The environment handed to every command we start
 
 
 // --- Shell configuration constants ---
-// Upper limit on number of arguments we will parse into argv[].
-// Chosen for simplicity; real shells grow argv dynamically.
-// One slot is always kept free for the NULL terminator.
-#define MAX_ARGS 64   // Hard limit to keep things simple
+// argv[] starts with room for this many words and doubles when it fills up,
+// until the system's ARG_MAX limit for exec() is reached.
+#define ARGV_INITIAL 64
+
+// Scripts and pipes are read (and stdout written) in blocks of this size
+// instead of a line at a time.
+#define IO_BUFSIZE (64 * 1024)
+
+static int last_status; // Exit status of the last command, used by `exit` and batch mode
+static unsigned cwd_version = 1; // Bumped by every change of directory (the zygote follows along)
+static unsigned env_version = 1; // Bumped by every change to the environment, likewise
 
 // Helpers for debugging 
 /*
@@ -50,182 +85,5800 @@ static void chomp(char *s) {
     // Note: This function assumes the input string is null-terminated, which getline() guarantees. 
 }
 
-// ------------------ Split a line into argv[] by whitespace only (no quotes/escapes yet) ------------------
-static int split(char *line, char *argv[], int maxargs) {
-    int argc = 0; // Argument count, starts at 0 
-    char *tok = strtok(line, " \t"); // Split by spaces and tabs. 
-    // Note that strtok modifies the input string, which is fine here.
-    while (tok && argc < maxargs - 1) { // -1 to leave space for NULL terminator 
-        argv[argc++] = tok;
-        tok = strtok(NULL, " \t");
+// ------------------ Per-line arena allocator ------------------
+// Everything a command line needs while it is parsed and run (argv[], pipeline
+// stages, PIDs, and later expanded words and redirections) is carved out of
+// big blocks with a simple pointer bump, and released all at once by
+// arena_reset() when the next line starts. The blocks themselves are kept for
+// reuse, so in steady state the read-eval loop calls neither malloc() nor free().
+#define ARENA_BLOCK (64 * 1024) // Default block size
+#define ARENA_ALIGN 16          // Enough for any type we store
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;           // Usable bytes in data[]
+    size_t used;           // Bytes handed out so far
+    unsigned char data[];
+};
+
+struct arena {
+    struct arena_block *head; // First block, where each line starts again
+    struct arena_block *cur;  // Block we are allocating from
+    void *last;               // Most recent allocation, can be grown in place
+};
+
+static struct arena arena; // Reset by repl() once per line, freed by cleanup()
+
+static void *arena_alloc(struct arena *a, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_block *b = a->cur;
+    while (b && b->size - b->used < n) { // Try the blocks kept from earlier lines
+        b = b->next;
+        if (b) b->used = 0;
+    }
+    if (!b) {
+        size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        b = malloc(sizeof *b + size);
+        if (!b) return NULL;
+        b->size = size;
+        b->used = 0;
+        b->next = NULL;
+        if (a->cur) { b->next = a->cur->next; a->cur->next = b; } // Right after cur
+        else a->head = b;
+    }
+    a->cur = b;
+    a->last = b->data + b->used;
+    b->used += n;
+    return a->last;
+}
+
+// Resize an allocation. The latest one just grows in place when the block has
+// room; anything else is copied into a fresh chunk (the old one is reclaimed at
+// the next reset).
+static void *arena_realloc(struct arena *a, void *old, size_t old_n, size_t new_n) {
+    if (old && old == a->last) {
+        struct arena_block *b = a->cur;
+        size_t start = (size_t)((unsigned char *)old - b->data);
+        size_t n = (new_n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (b->size - start >= n) { b->used = start + n; return old; }
     }
-    argv[argc] = NULL;
-    return argc;
+    void *p = arena_alloc(a, new_n);
+    if (p && old) memcpy(p, old, old_n < new_n ? old_n : new_n);
+    return p;
 }
 
-// ------------------ Cleanup helper ------------------
-static void cleanup(char **linep) {
-    free(*linep);
-    *linep = NULL;
+static void arena_reset(struct arena *a) {
+    a->cur = a->head;
+    if (a->cur) a->cur->used = 0; // Later blocks are rewound when we reach them
+    a->last = NULL;
 }
 
-// ------------------Built-in commands: exit, cd ------------------
-static int try_builtin(char *argv[], char **linep) {
-    if (!argv[0]) return 1; // Nothing to do, returns 1 meaning command is handled. 
-    if (strcmp(argv[0], "exit") == 0) {
-        cleanup(linep); // Free the line buffer before exiting 
-        exit(0);
+static void arena_free(struct arena *a) {
+    for (struct arena_block *b = a->head, *next; b; b = next) { next = b->next; free(b); }
+    a->head = a->cur = NULL;
+    a->last = NULL;
+}
+
+// Make sure the arena array *bufp has room for at least `need` elements of
+// `size` bytes, doubling its capacity as needed. Existing contents are kept.
+static int arena_grow(void **bufp, size_t *capp, size_t need, size_t size) {
+    if (need <= *capp) return 0;
+    size_t cap = *capp ? *capp : ARGV_INITIAL;
+    while (cap < need) cap *= 2;
+    void *p = arena_realloc(&arena, *bufp, *capp * size, cap * size);
+    if (!p) return -1;
+    *bufp = p;
+    *capp = cap;
+    return 0;
+}
+
+// ------------------ Tokenizer: split a line into tokens ------------------
+// One pass over the line: every byte is classified with a single table lookup
+// (no strtok() rescanning its delimiter set per byte), words are NUL-terminated
+// in place and the token list grows as needed.
+// Operators (|, &, ;, &&, ||, <, >, ...) end a word even without spaces around them, so
+// "ls>out" and "cmd 2>&1" work. Redirections are turned into TK_REDIR tokens
+// right here, so nothing later has to re-scan argv[] for them.
+// Quotes work as in sh: '...' takes everything literally, "..." everything but
+// $ (and \ before $ " \), and \ outside quotes the next byte. Quote removal
+// happens here too; a byte that must stay literal through expansion (a quoted
+// $, say) is marked with QUOTE_MARK in front, see expand_word().
+#define QUOTE_MARK '\001'
+
+enum char_class {
+    CC_WORD = 0, // Ordinary word byte (the default for the whole table)
+    CC_DIGIT,    // 0-9: a word of digits right before < or > is a file descriptor
+    CC_HASH,     // '#': starts a comment at the beginning of a word, else part of it
+    CC_QUOTE,    // ' " \: the word needs quote removal, see scan_quoted()
+    CC_OP,       // First byte of an operator
+    CC_SPACE,    // Word separator
+    CC_END,      // End of the line
+};
+
+static const unsigned char char_class[256] = {
+    ['\0'] = CC_END, ['\n'] = CC_END,
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\r'] = CC_SPACE,
+    ['#'] = CC_HASH,
+    ['\''] = CC_QUOTE, ['"'] = CC_QUOTE, ['\\'] = CC_QUOTE,
+    ['0'] = CC_DIGIT, ['1'] = CC_DIGIT, ['2'] = CC_DIGIT, ['3'] = CC_DIGIT, ['4'] = CC_DIGIT,
+    ['5'] = CC_DIGIT, ['6'] = CC_DIGIT, ['7'] = CC_DIGIT, ['8'] = CC_DIGIT, ['9'] = CC_DIGIT,
+    ['|'] = CC_OP, ['<'] = CC_OP, ['>'] = CC_OP, ['&'] = CC_OP, [';'] = CC_OP,
+};
+
+enum token_kind {
+    TK_WORD, TK_PIPE, TK_REDIR,
+    TK_AMP, TK_SEMI, TK_AND, TK_OR, // &  ;  &&  || : these separate pipelines
+};
+
+static const char *const token_names[] = {
+    [TK_PIPE] = "|", [TK_AMP] = "&", [TK_SEMI] = ";", [TK_AND] = "&&", [TK_OR] = "||",
+};
+
+// Redirection operators. N is the fd in front, e.g. the 2 of 2>file.
+enum redir_op {
+    R_IN,     // [N]<file    (N defaults to 0)
+    R_OUT,    // [N]>file    (N defaults to 1), also >|
+    R_APPEND, // [N]>>file
+    R_INOUT,  // [N]<>file   read and write, no truncation
+    R_DUP,    // [N]>&M, [N]<&M: make N a copy of M; M "-" closes N
+    R_HEREDOC, // [N]<<WORD, [N]<<-WORD: the lines up to WORD (N defaults to 0)
+    R_HERESTR, // [N]<<<word: the word and a newline
+};
+
+// open() flags for each kind of file redirection
+static const int redir_flags[] = {
+    [R_IN]     = O_RDONLY,
+    [R_OUT]    = O_WRONLY | O_CREAT | O_TRUNC,
+    [R_APPEND] = O_WRONLY | O_CREAT | O_APPEND,
+    [R_INOUT]  = O_RDWR | O_CREAT,
+};
+
+static const char *const redir_names[] = {
+    [R_IN] = "<", [R_OUT] = ">", [R_APPEND] = ">>", [R_INOUT] = "<>", [R_DUP] = ">&",
+    [R_HEREDOC] = "<<", [R_HERESTR] = "<<<",
+};
+
+struct token {
+    unsigned char kind; // TK_*
+    unsigned char op;   // TK_REDIR: R_*
+    unsigned char tabs; // TK_REDIR: <<-, the here-document drops leading tabs
+    unsigned char quoted; // TK_WORD: had quotes in it (a here-document's WORD then means no expansion)
+    int fd;             // TK_REDIR: the fd being redirected
+    unsigned plain;     // TK_WORD: bytes before the first quote or \ (all of them if none)
+    char *text;         // TK_WORD: the word, NUL-terminated inside the line
+};
+
+struct tokvec {
+    struct token *v; // In the arena
+    size_t len;      // Tokens in v
+    size_t cap;      // Allocated slots
+    char *end;       // Where the line ended: words are in [line, end] or in the arena
+};
+
+// Decode the operator at p into *t (fd = -1 means "use the default").
+// Returns its length in bytes.
+static size_t scan_operator(const unsigned char *p, struct token *t, int fd) {
+    t->text = NULL;
+    t->tabs = 0;
+    if (p[0] == '|') { t->kind = p[1] == '|' ? TK_OR : TK_PIPE; return t->kind == TK_OR ? 2 : 1; }
+    if (p[0] == '&') { t->kind = p[1] == '&' ? TK_AND : TK_AMP; return t->kind == TK_AND ? 2 : 1; }
+    if (p[0] == ';') { t->kind = TK_SEMI; return 1; }
+    t->kind = TK_REDIR;
+    size_t len = 2;
+    if (p[0] == '<') {
+        if (p[1] == '>')      t->op = R_INOUT;
+        else if (p[1] == '&') t->op = R_DUP;
+        else if (p[1] == '<') { // <<, <<- or <<<
+            t->op = p[2] == '<' ? R_HERESTR : R_HEREDOC;
+            t->tabs = p[2] == '-';
+            len += p[2] == '<' || p[2] == '-';
+        }
+        else                { t->op = R_IN; len = 1; }
+        t->fd = fd >= 0 ? fd : STDIN_FILENO;
+    } else {
+        if (p[1] == '>')      t->op = R_APPEND;
+        else if (p[1] == '&') t->op = R_DUP;
+        else if (p[1] == '|') t->op = R_OUT; // >| is > since there is no noclobber
+        else                { t->op = R_OUT; len = 1; }
+        t->fd = fd >= 0 ? fd : STDOUT_FILENO;
+    }
+    return len;
+}
+
+// Bytes that mean something to expand_word(), and so need a QUOTE_MARK when quoted.
+static int is_expansion_byte(int c) {
+    return c == '$' || c == '*' || c == '?' || c == '[' || c == QUOTE_MARK;
+}
+
+// Where the word with quotes in it at p ends, at the latest: the first
+// unquoted space or operator, or `end` (the end of the line). Only the
+// word's own bytes are looked at, so a line of many quoted words stays linear.
+static const unsigned char *quoted_end(const unsigned char *p, const unsigned char *end) {
+    while (p < end && char_class[*p] <= CC_QUOTE) {
+        unsigned char q = *p++;
+        if (char_class[q] != CC_QUOTE) continue;
+        if (q == '\\') { if (p < end) p++; continue; }
+        while (p < end && *p != q) p += q == '"' && *p == '\\' && p + 1 < end ? 2 : 1;
+        if (p < end) p++; // The closing quote
     }
-    if (strcmp(argv[0], "cd") == 0) {
-        const char *dest = argv[1] ? argv[1] : getenv("HOME");
-        if (!dest) { fprintf(stderr, "cd: HOME not set\n"); return 1; }
-        if (chdir(dest) != 0) perror("cd");
-        return 1; // handled
+    return p;
+}
+
+static int is_name_start(int c);
+static int is_name_char(int c);
+
+// A quote ends a $NAME as much as a space does: "$HOME"x is /rootx, not
+// $HOMEx. Where the quoting changes, the name the word was in the middle
+// of (the bytes [name, o) after its $) becomes ${NAME}, and a $ with no
+// name at all, as in "$"x, stays a $. Returns the new end.
+static char *brace_name(char *name, char *o) {
+    if (name && name == o) { name[-1] = QUOTE_MARK; *o++ = '$'; return o; }
+    if (!name || !is_name_start((unsigned char)*name)) return o;
+    for (const char *c = name; c < o; c++) if (!is_name_char((unsigned char)*c)) return o;
+    memmove(name + 1, name, (size_t)(o - name));
+    *name = '{';
+    o[1] = '}';
+    return o + 2;
+}
+
+// A word with quotes in it, from `start` in a line that ends at `end`: copy
+// it to the arena without the quotes and with QUOTE_MARKs. Sets *text and
+// returns the end of the word in the line, or NULL (after reporting it) if a
+// quote is not closed.
+static unsigned char *scan_quoted(unsigned char *start, const unsigned char *end, char **text) {
+    // Every byte of the word becomes at most two: a QUOTE_MARK and itself;
+    // a quote that ends a $NAME pays for the braces.
+    size_t room = 2 * (size_t)(quoted_end(start, end) - start) + 1;
+    char *out = arena_alloc(&arena, room), *o = out, *name = NULL; // Just past the last $
+    if (!out) { perror("mtsh"); return NULL; }
+    unsigned char *p = start;
+    for (;;) {
+        unsigned cls = char_class[*p];
+        if (cls > CC_QUOTE) break; // Unquoted space, operator or end: the word ends
+        if (cls != CC_QUOTE) {
+            *o++ = (char)*p++;
+            if (o[-1] == '$') name = o;
+            continue;
+        }
+
+        o = brace_name(name, o);
+        name = NULL;
+        unsigned char q = *p++;
+        if (q == '\\') { // Next byte literally; a trailing backslash stays itself
+            unsigned char c = *p ? *p++ : '\\';
+            if (is_expansion_byte(c)) *o++ = QUOTE_MARK;
+            *o++ = (char)c;
+            continue;
+        }
+        for (; *p != q; p++) {
+            if (*p == '\0') { fprintf(stderr, "mtsh: syntax error: unterminated %c\n", q); return NULL; }
+            unsigned char c = *p;
+            if (q == '"' && c == '\\' && (p[1] == '$' || p[1] == '"' || p[1] == '\\')) c = *++p;
+            else if (q == '"' && c == '$') { // Expanded inside "...", $? included
+                *o++ = '$';
+                name = o;
+                if (p[1] == '?') { *o++ = *++p; name = NULL; }
+                continue;
+            }
+            if (is_expansion_byte(c)) *o++ = QUOTE_MARK;
+            *o++ = (char)c;
+        }
+        p++; // The closing quote
+        if (q == '"') o = brace_name(name, o);
+        name = NULL;
     }
-    return 0; // Not a builtin
+    *o = '\0';
+    *text = out;
+    return p;
 }
 
-int main(void) {
-    char *line = NULL; 
-    size_t cap = 0;
-    // You can delete or comment out this part if you don't want the banner.
-    printf("                      _             _          _ _ \n");
-    printf("  ___ _ __ ___  _ __ | |_ _   _ ___| |__   ___| | |\n");
-    printf(" / _ \\ '_ ` _ \\| '_ \\| __| | | / __| '_ \\ / _ \\ | |\n");
-    printf("|  __/ | | | | | |_) | |_| |_| \\__ \\ | | |  __/ | |\n");
-    printf(" \\___|_| |_| |_| .__/ \\__|\\__, |___/_| |_|\\___|_|_|\n");
-    printf("               |_|        |___/                    \n");
-    printf(" emptyshell — Minimal Teaching Shell v0.2.0\n");
-    printf(" POSIX.1-2008 • Simple • Hackable\n");
-    printf("-----------------------------------------------------\n\n");
+// Split `line` of `len` bytes (modified in place) into tokens. Returns the token count,
+// or -1 if the line has more words than exec() can take, or a quote is not closed.
+static int tokenize(char *line, size_t len, struct tokvec *tv) {
+    static size_t max_words;
+    if (!max_words) { // ARG_MAX bytes can hold at most this many pointers
+        long arg_max = sysconf(_SC_ARG_MAX);
+        max_words = (arg_max > 0 ? (size_t)arg_max : 131072) / sizeof(char *);
+    }
 
-    // Infinite loop to read commands 
+    unsigned char *p = (unsigned char *)line;
+    size_t words = 0;
+    tv->v = NULL;
+    tv->len = tv->cap = 0;
     for (;;) {
-        // Prompt        
-        printf("> "); // Old-school prompt, just one character
-        fflush(stdout); // Ensure prompt is printed before reading input
+        while (char_class[*p] == CC_SPACE) p++;
+        unsigned cls = char_class[*p];
+        if (cls >= CC_SPACE) break; // End of line
+        if (*p == '#') break;       // A comment runs to the end of the line
+        // Room for this token and a glued operator after it
+        if (arena_grow((void **)&tv->v, &tv->cap, tv->len + 2, sizeof *tv->v) < 0) { perror("mtsh"); return -1; }
+        struct token *t = &tv->v[tv->len++];
+        if (cls == CC_OP) { p += scan_operator(p, t, -1); continue; }
 
-        // ------------------ Read input ------------------
-        ssize_t n = getline(&line, &cap, stdin); // Read a line from stdin.
-        // ssize_t is a signed type for sizes, defined in <sys/types.h> which is included via <unistd.h>,
-        // getline() expects this type for its return value. 
-        // cap = capacity in bytes of the line buffer, getline() will reuse it on subsequent calls,
-        // and resize it if it's too small. 
-        if (n < 0) { putchar('\n'); break; } // EOF/Ctrl-D exits the infinite loop and ends the shell
-        chomp(line); // Remove trailing newline, see its definition above.
-        if (line[0] == '\0') continue;      // Ignore empty lines, skip to next iteration
+        unsigned char *start = p;
+        int digits = 1;
+        while ((cls = char_class[*p]) <= CC_HASH) { digits &= cls == CC_DIGIT; p++; } // Scan to the end of the word
+        if (cls == CC_OP && digits && (*p == '<' || *p == '>') && p - start < 9) {
+            p += scan_operator(p, t, atoi((char *)start)); // "2>": the digits name the fd
+            continue;
+        }
+        if (++words >= max_words) { fprintf(stderr, "mtsh: argument list too long\n"); return -1; }
+        t->kind = TK_WORD;
+        t->text = (char *)start;
+        t->quoted = cls == CC_QUOTE;
+        t->plain = (unsigned)(p - start); // scan_quoted() copies these bytes as they are
+        if (cls == CC_QUOTE) { // The rarer slow path: the word is rebuilt in the arena
+            if (!(p = scan_quoted(start, (unsigned char *)line + len, &t->text))) return -1;
+            cls = char_class[*p];
+        }
+        if (cls == CC_OP) { // "ls>out": decode the operator before its first byte becomes the NUL
+            size_t n = scan_operator(p, &tv->v[tv->len++], -1);
+            *p = '\0';
+            p += n;
+            continue;
+        }
+        if (!t->quoted) t->plain = (unsigned)(p - start);
+        if (cls == CC_END) { *p = '\0'; break; }
+        *p++ = '\0';
+    }
+    tv->end = (char *)p;
+    return (int)tv->len;
+}
 
-        // ------------------ Parse input ------------------
-        char *argv[MAX_ARGS];
-        int argc = split(line, argv, MAX_ARGS); // Split the line into arguments by whitespace.
-        // split() modifies the input line, so argv[] points to parts of the same memory
-        // Note: split() returns the number of arguments parsed, which is stored in argc.
-        // If argc is 0, it means the line was empty or contained only whitespace.
-        // If argc is 1, it means there is only one argument (the command itself).
-        // If argc is greater than 1, it means there are multiple arguments (command + options/arguments).
-        // The last element of argv[] is always NULL, which is required for execvp() to know where the arguments end.
-        // This is a common pattern in C for handling command-line arguments.
-        // Note: We assume the input is well-formed and does not contain more than MAX_ARGS - 1 arguments.
-        // If it does, the last argument will be truncated, but this is a simple shell so we don't handle that case.
-
-        if (argc == 0) continue;
-
-        // ------------------ Built-in commands ------------------
-        if (try_builtin(argv, &line)) continue; // If it's a built-in command, run it, then skip to next iteration
+// ------------------ Redirections ------------------
+// The tokenizer already turned every redirection into a TK_REDIR token;
+// parse_pipeline() collects them per stage into a compact array of struct
+// redir, in the order they were written. The same list is then either:
+//   - turned into posix_spawn file actions for an external command, or
+//   - applied to the shell itself around a builtin, with the old fds parked
+//     (F_DUPFD_CLOEXEC) and restored afterwards, or
+//   - applied in a forked child right before execv().
+struct redir {
+    int fd;             // The fd being redirected
+    unsigned char op;   // R_*
+    int dupfd;          // R_DUP: fd to copy, or -1 to close fd
+    const char *target; // File name for the other ops
+};
 
-        // ------------------ exec external command ------------------
-        pid_t pid = fork(); // Create a new process, 
-        // pid_t is the process ID type from <sys/types.h> via <unistd.h>. 
-        // This is usually just an int, but it's good practice to use the type defined by the system.
-
-        // In a way, the fork() is the punch line of the whole thing:
-        // fork() creates a new process that is a copy of the current process,
-        // after the fork there are two processes running the same code.
-        // - If fork() returns a negative value, it means an error occurred.
-        // - If fork() returns 0, we are in the child process (the new one).
-        // - If fork() returns a positive value, we are in the parent (original) process, and
-        //   the return value is the PID of the child process.
-        // The child process will execute the command, while the parent will wait for it to finish.
-        if (pid < 0) { // Fork failed, error  
-            perror("fork"); // Print error 
-            continue; // and skip to next iteration
-        }
-        if (pid == 0) { // We are in the child (new) process
-            // Set up signal handling for child process (optional, not implemented here)
-
-            // Redirections (>, <, >>, etc.) go here when implemented 
-            // We will start small with only >  
-            // Check if argv contains ">"
-            for (int i = 0; argv[i] != NULL; i++) {
-                if (strcmp(argv[i], ">") == 0) {
-                    // argv[i] is ">", argv[i+1] is filename
-                    int fd = open(argv[i+1], O_CREAT | O_WRONLY | O_TRUNC, 0644);
-                    if (fd < 0) { 
-                        fprintf(stderr, "mtsh: cannot open %s for writing: ", argv[i+1]);
-                        perror("");   
-                        exit(1);           
-                    }
-
-                    if (dup2(fd, STDOUT_FILENO) < 0) {
-                        perror("mtsh: dup2 stdout"); 
-                        _exit(1);
-                    }
-
-                    close(fd);
-
-                    argv[i] = NULL; // cut off argv so execvp sees only the command
-                    break;
-                }
+// One command of a pipeline: its argv[] and its redirections.
+struct stage {
+    char **argv;          // NULL-terminated, slices of the line
+    struct redir *redirs; // In the arena
+    int nredirs;
+    char **assigns;       // NAME=value words in front of the command
+    int nassigns;         // (argv[0] is NULL for a line of only assignments)
+};
+
+// A parked fd: `copy` holds the original fd `fd` (or -1 if it was not open).
+struct saved_fd {
+    int fd;
+    int copy;
+};
+
+// Apply redirections to this process. With `save` (room for n entries) every
+// fd touched is parked first so restore_redirs() can undo everything; without
+// it (in a child about to exec) the changes are for good.
+// Returns 0, or -1 after printing an error.
+static int apply_redirs(const struct redir *rd, int n, struct saved_fd *save, int *nsaved) {
+    for (int i = 0; i < n; i++) {
+        const struct redir *r = &rd[i];
+        if (save) {
+            int seen = 0;
+            for (int j = 0; j < *nsaved; j++) seen |= save[j].fd == r->fd;
+            if (!seen) {
+                int copy = fcntl(r->fd, F_DUPFD_CLOEXEC, 10); // Above the fds scripts use
+                if (copy < 0 && errno != EBADF) { perror("mtsh: fcntl"); return -1; }
+                save[*nsaved].fd = r->fd;
+                save[*nsaved].copy = copy;
+                (*nsaved)++;
+            }
+        }
+        if (r->op == R_DUP) {
+            if (r->dupfd < 0) close(r->fd);
+            else if (r->dupfd != r->fd && dup2(r->dupfd, r->fd) < 0) {
+                fprintf(stderr, "mtsh: %d: %s\n", r->dupfd, strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+        int fd = open(r->target, redir_flags[r->op] | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "mtsh: cannot open %s: %s\n", r->target, strerror(errno));
+            return -1;
+        }
+        if (fd == r->fd) { fcntl(fd, F_SETFD, 0); continue; } // Landed on the right fd already
+        if (dup2(fd, r->fd) < 0) { perror("mtsh: dup2"); close(fd); return -1; }
+        close(fd);
+    }
+    return 0;
+}
+
+// Put back the fds parked by apply_redirs(), newest first.
+static void restore_redirs(struct saved_fd *save, int n) {
+    while (n-- > 0) {
+        if (save[n].copy < 0) { close(save[n].fd); continue; }
+        dup2(save[n].copy, save[n].fd);
+        close(save[n].copy);
+    }
+}
+
+// posix_spawn() reports a failed file action just like a failed exec, with an
+// error number only. Replay the file redirections in order to find the one that
+// fails with that error, so the message can name the right file.
+static const char *redir_blame(const struct stage *st, int err) {
+    for (int i = 0; i < st->nredirs; i++) {
+        const struct redir *r = &st->redirs[i];
+        if (r->op == R_DUP) continue;
+        int fd = open(r->target, (redir_flags[r->op] & ~O_TRUNC) | O_CLOEXEC, 0644);
+        if (fd >= 0) { close(fd); continue; }
+        if (errno == err) return r->target;
+        break;
+    }
+    return NULL;
+}
+
+// ------------------ Cleanup helper ------------------
+static void cleanup(void) {
+    arena_free(&arena); // Everything the current line allocated lives here
+}
+
+// ------------------ Shell variables and the environment ------------------
+// All variables live in one hash table, the environment we were started with
+// included (imported by vars_init()). A variable marked for export is also in
+// the environment of the commands we start. That environment is an array of
+// pointers to the variables' own "NAME=value" strings, rebuilt by env_sync()
+// only when an exported variable changed since the last command, so a script
+// that keeps setting variables does not pay for it on every exec.
+#define VARS_INITIAL 64   // Buckets to start with, doubled as the table fills
+#define ENV_GRAVEYARD 256 // Replaced strings kept until env_sync(), see var_entry_free()
+
+struct var {
+    struct var *next;       // Next variable in the same bucket
+    unsigned hash;
+    unsigned char exported;
+    size_t namelen;
+    char *entry;            // "NAME=value", malloc()ed; the value starts at entry + namelen + 1
+};
+
+static struct var **vars;      // Buckets, a power of two of them
+static size_t vars_cap, nvars;
+static char **env_array;       // What `environ` points to after env_sync()
+static size_t env_cap;
+static int env_dirty;          // An exported variable changed since env_sync()
+static char *env_graveyard[ENV_GRAVEYARD]; // Strings environ may still point to
+static size_t env_ngrave;
+static pid_t shell_pid, last_bg_pid; // $$ and $!
+
+// FNV-1a: small, fast and good enough for names.
+static unsigned hash_bytes(const char *s, size_t n) {
+    unsigned h = 2166136261u;
+    while (n--) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+static int is_name_start(int c) { return c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'); }
+static int is_name_char(int c) { return is_name_start(c) || (c >= '0' && c <= '9'); }
+
+// Length of the variable name at the start of s (0 if there is none).
+static size_t name_len(const char *s) {
+    size_t n = 0;
+    if (!is_name_start((unsigned char)s[0])) return 0;
+    while (is_name_char((unsigned char)s[n])) n++;
+    return n;
+}
+
+static struct var *var_find(const char *name, size_t len) {
+    if (!vars) return NULL;
+    unsigned h = hash_bytes(name, len);
+    for (struct var *v = vars[h & (vars_cap - 1)]; v; v = v->next)
+        if (v->hash == h && v->namelen == len && memcmp(v->entry, name, len) == 0) return v;
+    return NULL;
+}
+
+// The value of a variable, or NULL if it is not set.
+static const char *var_get(const char *name) {
+    struct var *v = var_find(name, strlen(name));
+    return v ? v->entry + v->namelen + 1 : NULL;
+}
+
+// An exported variable's old string may still be in environ until the next
+// env_sync(), so it is parked instead of freed right away.
+static void var_entry_free(struct var *v) {
+    if (!v->exported) { free(v->entry); return; }
+    env_dirty = 1;
+    if (env_ngrave == ENV_GRAVEYARD) { // Full: no environ until the next env_sync(), then nothing points here
+        environ = NULL;
+        for (size_t i = 0; i < env_ngrave; i++) free(env_graveyard[i]);
+        env_ngrave = 0;
+    }
+    env_graveyard[env_ngrave++] = v->entry;
+}
+
+static int vars_grow(void) {
+    size_t cap = vars_cap ? vars_cap * 2 : VARS_INITIAL;
+    struct var **nb = calloc(cap, sizeof *nb);
+    if (!nb) return -1;
+    for (size_t i = 0; i < vars_cap; i++)
+        for (struct var *v = vars[i], *next; v; v = next) {
+            next = v->next;
+            v->next = nb[v->hash & (cap - 1)];
+            nb[v->hash & (cap - 1)] = v;
+        }
+    free(vars);
+    vars = nb;
+    vars_cap = cap;
+    return 0;
+}
+
+// Set NAME (the first len bytes of name) to value. export: 1 marks it for
+// export, 0 unmarks it, -1 leaves the mark as it was. Returns 0 or -1.
+static int var_set(const char *name, size_t len, const char *value, int export) {
+    struct var *v = var_find(name, len);
+    size_t vlen = strlen(value);
+    char *entry = malloc(len + vlen + 2);
+    if (!entry) { perror("mtsh"); return -1; }
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, vlen + 1);
+
+    if (!v) {
+        if (nvars >= vars_cap && vars_grow() < 0) { free(entry); perror("mtsh"); return -1; }
+        if (!(v = calloc(1, sizeof *v))) { free(entry); perror("mtsh"); return -1; }
+        v->hash = hash_bytes(name, len);
+        v->namelen = len;
+        v->next = vars[v->hash & (vars_cap - 1)];
+        vars[v->hash & (vars_cap - 1)] = v;
+        nvars++;
+    } else {
+        var_entry_free(v);
+    }
+    v->entry = entry;
+    if (export >= 0) { env_dirty |= v->exported != export; v->exported = (unsigned char)export; }
+    env_dirty |= v->exported;
+    return 0;
+}
+
+static void var_unset(const char *name, size_t len) {
+    struct var *v = var_find(name, len);
+    if (!v) return;
+    struct var **pp = &vars[v->hash & (vars_cap - 1)];
+    while (*pp != v) pp = &(*pp)->next;
+    *pp = v->next;
+    var_entry_free(v);
+    free(v);
+    nvars--;
+}
+
+// Point environ at a fresh array of the exported variables, if anything changed.
+static void env_sync(void) {
+    if (!env_dirty && environ) return;
+    size_t n = 0;
+    for (size_t i = 0; i < vars_cap; i++)
+        for (struct var *v = vars[i]; v; v = v->next) n += v->exported;
+    if (n + 1 > env_cap) {
+        char **a = realloc(env_array, (n + 1) * sizeof *a);
+        if (!a) { perror("mtsh: environment"); return; } // Keep the old one
+        env_array = a;
+        env_cap = n + 1;
+    }
+    n = 0;
+    for (size_t i = 0; i < vars_cap; i++)
+        for (struct var *v = vars[i]; v; v = v->next)
+            if (v->exported) env_array[n++] = v->entry;
+    env_array[n] = NULL;
+    environ = env_array;
+    for (size_t i = 0; i < env_ngrave; i++) free(env_graveyard[i]); // Nothing points to them now
+    env_ngrave = 0;
+    env_dirty = 0;
+    env_version++; // The zygote picks it up with the next command
+}
+
+// Take over the environment we were started with.
+static void vars_init(void) {
+    shell_pid = getpid();
+    for (char **e = environ; *e; e++) {
+        const char *eq = strchr(*e, '=');
+        if (eq && eq != *e) var_set(*e, (size_t)(eq - *e), eq + 1, 1);
+    }
+    env_sync();
+}
+
+// A variable's value before a `NAME=value cmd` prefix changed it.
+struct saved_var {
+    const char *name; // The assignment word, NAME=...
+    size_t len;
+    char *value;      // Old value in the arena, NULL if it was not set
+    int exported;
+};
+
+// Apply the NAME=value words in front of a command. With `save` (room for n)
+// they are temporary and exported, for that command only: restore_vars()
+// puts the old values back. Without, they are set for good.
+static int assign_vars(char **assigns, int n, struct saved_var *save) {
+    for (int i = 0; i < n; i++) {
+        size_t len = name_len(assigns[i]);
+        if (save) {
+            struct var *v = var_find(assigns[i], len);
+            save[i] = (struct saved_var){ assigns[i], len, NULL, v && v->exported };
+            if (v) {
+                const char *old = v->entry + len + 1;
+                if ((save[i].value = arena_alloc(&arena, strlen(old) + 1))) strcpy(save[i].value, old);
             }
+        }
+        if (var_set(assigns[i], len, assigns[i] + len + 1, save ? 1 : -1) < 0) return -1;
+    }
+    return 0;
+}
 
+static void restore_vars(struct saved_var *save, int n) {
+    for (int i = n - 1; i >= 0; i--) { // Backwards, in case a name was assigned twice
+        if (save[i].value) var_set(save[i].name, save[i].len, save[i].value, save[i].exported);
+        else var_unset(save[i].name, save[i].len);
+    }
+}
 
-            // Pipes setup if needed (not implemented in this simple shell, but could be added later)
-
-
-
-
-            // ------------------ Execute command ------------------
-            // If execvp fails, it will return and we handle the error below
-            // Note: execvp searches the PATH environment variable for the command 
-            // child: execute (PATH search via execvp) 
-            execvp(argv[0], argv); // Execute the command. execvp() does not return on success,
-            // it replaces the current process image with a new one.
-            // If execvp() returns, it means there was an error
-            perror(argv[0]);   // only reached on error
-            _exit(127); // Exit child with error code 127 (command not found)
-        } else { // pid > 0, we are in the parent process
-            // ------------------ Wait for child process ------------------ 
-            // There is no job control in this simple shell yet. 
-            int status = 0;
-            if (waitpid(pid, &status, 0) < 0) { // Wait for the child process to finish
-            // waitpid() waits for the child process with PID pid to change state.
-            // If the child process has already exited, it returns immediately. 
-                perror("waitpid");
-            // Check if the child exited normally or was killed by a signal
-            } else if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-                // Child exited normally with exit code 0
-                // No output needed, just continue 
-            } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-                // Child exited with a non-zero exit code
-                // Print the exit code
-                // Note: WEXITSTATUS(status) extracts the exit code from the status 
-                fprintf(stderr, "%s: exit code: %d\n", argv[0], WEXITSTATUS(status));
-            } else if (WIFSIGNALED(status)) {
-                // Child was killed by a signal
-                // Print the signal number that killed the child
-                // Note: WTERMSIG(status) extracts the signal number from the status
-                // This is useful for debugging or understanding why a command failed
-                // e.g., if the command was killed by SIGKILL or SIGSEGV 
-                fprintf(stderr, "%s: killed by signal %d (%s)\n", argv[0], WTERMSIG(status), 
-                strsignal(WTERMSIG(status)));
-            }
-        }
-    }
-
-    cleanup(&line); // Free the line buffer before exiting
-    // Note: We don't need to check if line is NULL, as getline() always allocates memory for it
-    // and we free it at the end of the program.
-    // This is a simple shell, so we don't need to handle memory leaks or other cleanup
-    // in a complex way. The OS will reclaim all memory used by the process when it exits. 
+static int var_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Print `export NAME='value'` for each exported variable, sorted, in a form
+// the shell can read back.
+static void print_exports(void) {
+    char **list = arena_alloc(&arena, (nvars + 1) * sizeof *list);
+    if (!list) { perror("export"); return; }
+    size_t n = 0;
+    for (size_t i = 0; i < vars_cap; i++)
+        for (struct var *v = vars[i]; v; v = v->next)
+            if (v->exported) list[n++] = v->entry;
+    qsort(list, n, sizeof *list, var_cmp);
+    for (size_t i = 0; i < n; i++) {
+        const char *eq = strchr(list[i], '=');
+        printf("export %.*s='", (int)(eq - list[i]), list[i]);
+        for (const char *p = eq + 1; *p; p++) {
+            if (*p == '\'') fputs("'\\''", stdout);
+            else putchar(*p);
+        }
+        fputs("'\n", stdout);
+    }
+}
+
+// export [NAME[=value] ...]: set and mark for export; no names: list them.
+static int builtin_export(char *argv[]) {
+    int status = 0;
+    if (!argv[1] || (strcmp(argv[1], "-p") == 0 && !argv[2])) { print_exports(); return 0; }
+    for (int i = 1; argv[i]; i++) {
+        size_t len = name_len(argv[i]);
+        if (len == 0 || (argv[i][len] != '=' && argv[i][len] != '\0')) {
+            fprintf(stderr, "export: %s: not a valid name\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        struct var *v = var_find(argv[i], len);
+        if (argv[i][len] == '=') var_set(argv[i], len, argv[i] + len + 1, 1);
+        else if (v && !v->exported) { v->exported = 1; env_dirty = 1; }
+        // `export NAME` for an unset NAME does nothing: there is no value to pass on
+    }
+    return status;
+}
+
+// unset [-v] NAME...
+static int builtin_unset(char *argv[]) {
+    int i = 1, status = 0;
+    if (argv[1] && strcmp(argv[1], "-v") == 0) i++;
+    for (; argv[i]; i++) {
+        if (name_len(argv[i]) != strlen(argv[i])) {
+            fprintf(stderr, "unset: %s: not a valid name\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        var_unset(argv[i], strlen(argv[i]));
+    }
+    return status;
+}
+
+// ------------------ PATH lookup cache (the `hash` builtin) ------------------
+// execvp() walks every $PATH directory on every call, paying one failed execve()
+// per directory before the hit. Instead we remember "name -> /full/path" the
+// first time a command is found and start it directly from then on.
+// The cache is dropped when $PATH changes, and a single entry is dropped
+// when starting it fails with ENOENT (the binary moved or was deleted).
+#define PATH_CACHE_SLOTS 256 // Hash buckets, must be a power of two
+
+struct path_entry {
+    struct path_entry *next; // Next entry in the same bucket
+    unsigned hits;           // How many times this entry was used, shown by `hash`
+    char *path;              // Resolved absolute path
+    char name[];             // Command name, stored inline after the struct
+};
+
+static struct path_entry *path_cache[PATH_CACHE_SLOTS];
+static char *path_cache_path;        // Copy of the $PATH the cache was filled from
+static unsigned long path_cache_hits, path_cache_misses;
+
+static unsigned hash_str(const char *s) { return hash_bytes(s, strlen(s)); }
+
+static void path_cache_clear(void) {
+    for (int i = 0; i < PATH_CACHE_SLOTS; i++) {
+        struct path_entry *e = path_cache[i], *next;
+        for (; e; e = next) { next = e->next; free(e->path); free(e); }
+        path_cache[i] = NULL;
+    }
+}
+
+static struct path_entry *path_cache_find(const char *name) {
+    struct path_entry *e = path_cache[hash_str(name) & (PATH_CACHE_SLOTS - 1)];
+    while (e && strcmp(e->name, name) != 0) e = e->next;
+    return e;
+}
+
+// Forget one command, e.g. after the cached binary disappeared.
+static void path_cache_forget(const char *name) {
+    struct path_entry **pp = &path_cache[hash_str(name) & (PATH_CACHE_SLOTS - 1)];
+    for (; *pp; pp = &(*pp)->next) {
+        if (strcmp((*pp)->name, name) == 0) {
+            struct path_entry *e = *pp;
+            *pp = e->next;
+            free(e->path); free(e);
+            return;
+        }
+    }
+}
+
+// Walk $PATH the same way execvp() does (an empty entry means the current
+// directory) and return a malloc()ed path to the first executable match.
+static char *path_search(const char *name, const char *path) {
+    size_t nlen = strlen(name);
+    for (const char *dir = path; ; ) {
+        const char *end = strchr(dir, ':');
+        size_t dlen = end ? (size_t)(end - dir) : strlen(dir);
+        char *full = malloc(dlen + nlen + 3);
+        if (!full) return NULL;
+        if (dlen == 0) { full[0] = '.'; dlen = 1; } else memcpy(full, dir, dlen);
+        full[dlen] = '/';
+        memcpy(full + dlen + 1, name, nlen + 1);
+        struct stat st;
+        if (stat(full, &st) == 0 && S_ISREG(st.st_mode) && access(full, X_OK) == 0)
+            return full;
+        free(full);
+        if (!end) return NULL;
+        dir = end + 1;
+    }
+}
+
+static char *trie_where(const char *name, const char *path); // See "Executable trie"
+
+// Resolve a command name to the path to execute. Names containing a '/' are
+// used as they are, like execvp() does. Returns NULL if nothing was found.
+static const char *path_lookup(const char *name) {
+    if (strchr(name, '/')) return name;
+
+    const char *path = var_get("PATH"); // Exported or not, it is the shell's search path
+    if (!path) path = "/usr/local/bin:/usr/bin:/bin";
+    if (!path_cache_path || strcmp(path, path_cache_path) != 0) { // $PATH changed
+        path_cache_clear();
+        free(path_cache_path);
+        path_cache_path = strdup(path);
+    }
+
+    struct path_entry *e = path_cache_find(name);
+    if (e) { e->hits++; path_cache_hits++; return e->path; }
+
+    path_cache_misses++;
+    char *full = trie_where(name, path); // Once completion has read $PATH anyway
+    if (!full) full = path_search(name, path);
+    if (!full) return NULL;
+    size_t nlen = strlen(name);
+    e = malloc(sizeof *e + nlen + 1);
+    if (!e) return full; // Cannot cache it, leak one path rather than fail the command
+    memcpy(e->name, name, nlen + 1);
+    e->path = full;
+    e->hits = 1;
+    unsigned slot = hash_str(name) & (PATH_CACHE_SLOTS - 1);
+    e->next = path_cache[slot];
+    path_cache[slot] = e;
+    return full;
+}
+
+// hash        list remembered commands with their hit counts
+// hash -r     forget everything
+// hash NAME   look NAME up now and remember it
+static int builtin_hash(char *argv[]) {
+    if (!argv[1]) {
+        int any = 0;
+        for (int i = 0; i < PATH_CACHE_SLOTS; i++) {
+            for (struct path_entry *e = path_cache[i]; e; e = e->next) {
+                if (!any) printf("hits\tcommand\n");
+                printf("%4u\t%s\n", e->hits, e->path);
+                any = 1;
+            }
+        }
+        if (!any) printf("hash: hash table empty\n");
+        printf("(%lu hits, %lu misses)\n", path_cache_hits, path_cache_misses);
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; argv[i]; i++) {
+        if (strcmp(argv[i], "-r") == 0) { path_cache_clear(); path_cache_hits = path_cache_misses = 0; continue; }
+        if (strchr(argv[i], '/')) continue; // Paths are never hashed
+        path_cache_forget(argv[i]);
+        if (!path_lookup(argv[i])) { fprintf(stderr, "hash: %s: not found\n", argv[i]); status = 1; continue; }
+        path_cache_find(argv[i])->hits = 0; // Looked up but not run yet, like other shells
+    }
+    return status;
+}
+
+// ------------------ Shell options (the `set` builtin) ------------------
+static int opt_pipefail; // set -o pipefail: a pipeline fails if any of its stages fails
+static int opt_timing;   // set -o timing: report resource usage of every command, like `time`
+
+static const struct shell_option {
+    const char *name;
+    int *flag;
+} shell_options[] = {
+    { "pipefail", &opt_pipefail },
+    { "timing",   &opt_timing },
+};
+#define N_SHELL_OPTIONS (int)(sizeof shell_options / sizeof shell_options[0])
+
+// set             list options
+// set -o NAME     turn an option on
+// set +o NAME     turn it off again
+static int builtin_set(char *argv[]) {
+    if (!argv[1] || (strcmp(argv[1], "-o") == 0 && !argv[2])) {
+        for (int i = 0; i < N_SHELL_OPTIONS; i++)
+            printf("%-15s %s\n", shell_options[i].name, *shell_options[i].flag ? "on" : "off");
+        return 0;
+    }
+    for (int i = 1; argv[i]; i += 2) {
+        int on = strcmp(argv[i], "-o") == 0;
+        if ((!on && strcmp(argv[i], "+o") != 0) || !argv[i+1]) {
+            fprintf(stderr, "set: usage: set [-o|+o option]\n");
+            return 2;
+        }
+        int j = 0;
+        while (j < N_SHELL_OPTIONS && strcmp(shell_options[j].name, argv[i+1]) != 0) j++;
+        if (j == N_SHELL_OPTIONS) { fprintf(stderr, "set: %s: invalid option name\n", argv[i+1]); return 2; }
+        *shell_options[j].flag = on;
+    }
+    return 0;
+}
+
+// ------------------ Self-measurement (the `stats` builtin) ------------------
+// The shell times its own main loop: reading a line, parsing it, running
+// builtins, starting processes and waiting for them, and the run time of
+// every command by name. A sample costs one clock_gettime(CLOCK_MONOTONIC),
+// which the vDSO answers without a syscall, and one increment in a
+// log-bucketed histogram: 8 buckets per power of two, so a reported value
+// is at most 12.5% above the true one, in 2 KiB per histogram for any
+// range from nanoseconds to years. `stats` prints p50, p99 and max.
+#define LAT_SUB_BITS 3
+#define LAT_SUB (1u << LAT_SUB_BITS)                    // Buckets per power of two
+#define LAT_NBUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB) // Up to 2^64 ns
+#define CMD_STAT_SLOTS 64                               // Hash buckets, a power of two
+
+struct latency {
+    uint64_t count, max;
+    uint32_t b[LAT_NBUCKETS];
+};
+
+enum { PH_READ, PH_PARSE, PH_BUILTIN, PH_SPAWN, PH_WAIT, NPHASES };
+static const char *const phase_names[NPHASES] = { "read", "parse", "builtin", "spawn", "wait" };
+static struct latency phases[NPHASES];
+
+struct cmd_stat {
+    struct cmd_stat *next;
+    struct latency lat;
+    char name[];
+};
+
+static struct cmd_stat *cmd_stats[CMD_STAT_SLOTS];
+static unsigned long n_spawned, n_forked, n_zygote; // Processes by how they started
+static unsigned long n_threaded; // Builtin pipeline stages run on a worker thread instead
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Values below LAT_SUB get a bucket each; above, the top LAT_SUB_BITS + 1
+// bits pick it: the power of two, then the next 3 bits below the leading one.
+static unsigned lat_bucket(uint64_t v) {
+    if (v < LAT_SUB) return (unsigned)v;
+#if defined(__GNUC__)
+    unsigned e = 63 - (unsigned)__builtin_clzll(v); // One instruction
+#else
+    unsigned e = 0;
+    for (uint64_t x = v; x >>= 1; ) e++;
+#endif
+    return (e - LAT_SUB_BITS + 1) * LAT_SUB + (unsigned)((v >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+// The highest value that lands in bucket i.
+static uint64_t lat_top(unsigned i) {
+    if (i < LAT_SUB) return i;
+    unsigned e = i / LAT_SUB + LAT_SUB_BITS - 1;
+    return ((uint64_t)(LAT_SUB + i % LAT_SUB + 1) << (e - LAT_SUB_BITS)) - 1;
+}
+
+static void lat_add(struct latency *l, uint64_t ns) {
+    l->count++;
+    l->b[lat_bucket(ns)]++;
+    if (ns > l->max) l->max = ns;
+}
+
+// The value below which a fraction q of the samples fall.
+static uint64_t lat_quantile(const struct latency *l, double q) {
+    uint64_t want = (uint64_t)(q * (double)l->count + 0.999999), seen = 0;
+    for (unsigned i = 0; i < LAT_NBUCKETS; i++)
+        if ((seen += l->b[i]) >= want && seen) return lat_top(i) < l->max ? lat_top(i) : l->max;
+    return l->max;
+}
+
+// Count one run of command `name` that took ns nanoseconds.
+static void cmd_stat_add(const char *name, uint64_t ns) {
+    struct cmd_stat **pp = &cmd_stats[hash_str(name) & (CMD_STAT_SLOTS - 1)];
+    while (*pp && strcmp((*pp)->name, name) != 0) pp = &(*pp)->next;
+    if (!*pp) {
+        size_t len = strlen(name) + 1;
+        struct cmd_stat *c = calloc(1, sizeof *c + len);
+        if (!c) return;
+        memcpy(c->name, name, len);
+        *pp = c;
+    }
+    lat_add(&(*pp)->lat, ns);
+}
+
+static const char *fmt_ns(char *buf, size_t size, uint64_t ns) {
+    if (ns < 1000) snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000) snprintf(buf, size, "%.1fus", (double)ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, size, "%.1fms", (double)ns / 1e6);
+    else snprintf(buf, size, "%.2fs", (double)ns / 1e9);
+    return buf;
+}
+
+static void print_latency(const char *name, const struct latency *l) {
+    char a[32], b[32], c[32];
+    printf("%-16s %10llu %10s %10s %10s\n", name, (unsigned long long)l->count,
+           fmt_ns(a, sizeof a, lat_quantile(l, 0.5)), fmt_ns(b, sizeof b, lat_quantile(l, 0.99)),
+           fmt_ns(c, sizeof c, l->max));
+}
+
+// stats      phases, commands, process and PATH cache counters
+// stats -r   start counting from zero again
+static int builtin_stats(char *argv[]) {
+    if (argv[1] && strcmp(argv[1], "-r") == 0) {
+        memset(phases, 0, sizeof phases);
+        for (int i = 0; i < CMD_STAT_SLOTS; i++) {
+            for (struct cmd_stat *c = cmd_stats[i], *next; c; c = next) { next = c->next; free(c); }
+            cmd_stats[i] = NULL;
+        }
+        n_spawned = n_forked = n_zygote = n_threaded = 0;
+        path_cache_hits = path_cache_misses = 0;
+        return 0;
+    }
+    if (argv[1]) { fprintf(stderr, "stats: usage: stats [-r]\n"); return 2; }
+    printf("%-16s %10s %10s %10s %10s\n", "phase", "count", "p50", "p99", "max");
+    for (int i = 0; i < NPHASES; i++) print_latency(phase_names[i], &phases[i]);
+    printf("\n%-16s %10s %10s %10s %10s\n", "command", "count", "p50", "p99", "max");
+    for (int i = 0; i < CMD_STAT_SLOTS; i++)
+        for (const struct cmd_stat *c = cmd_stats[i]; c; c = c->next) print_latency(c->name, &c->lat);
+    unsigned long lookups = path_cache_hits + path_cache_misses;
+    printf("\nprocesses: %lu posix_spawn, %lu fork, %lu zygote; %lu builtin stages on threads\n",
+           n_spawned, n_forked, n_zygote, n_threaded);
+    printf("PATH cache: %lu hits, %lu misses (%.1f%% hits)\n", path_cache_hits, path_cache_misses,
+           lookups ? 100.0 * (double)path_cache_hits / (double)lookups : 0.0);
+    return 0;
+}
+
+// ------------------ Execution log (--exec-log=FILE) ------------------
+// With --exec-log=FILE every process the shell starts gets one JSON line in
+// FILE when it ends: argv, cwd, pid, start and end time (seconds since the
+// epoch), user and system time, max RSS, and the exit code or signal.
+// Builtins that run inside the shell are not processes and are not logged.
+// The start of a record is rendered when the process starts; the rest is
+// added when it is reaped. Finished records wait in memory and go out
+// EXEC_LOG_BATCH at a time in one writev() on an O_APPEND fd (and at exit),
+// so 100k commands cost about 1.6k writes, not 100k. A forked subshell
+// starts with an empty batch (the parent still writes those records) and
+// writes its own before it exits.
+#define EXEC_LOG_BATCH 64
+
+static int exec_log_fd = -1;
+static struct iovec exec_log_iov[EXEC_LOG_BATCH]; // Finished records, malloc()ed
+static int exec_log_n;
+static char *exec_log_cwd;              // getcwd() once per directory change, not per command
+static unsigned exec_log_cwd_version;
+
+static void exec_log_flush(void) {
+    if (exec_log_n == 0) return;
+    ssize_t r = writev(exec_log_fd, exec_log_iov, exec_log_n); // Short writes lose the rest: it is a log
+    (void)r;
+    for (int i = 0; i < exec_log_n; i++) free(exec_log_iov[i].iov_base);
+    exec_log_n = 0;
+}
+
+// In a forked child: the pending records are the parent's to write.
+static void exec_log_forked(void) { exec_log_n = 0; }
+
+static int exec_log_open(const char *path) {
+    exec_log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (exec_log_fd < 0) { fprintf(stderr, "mtsh: %s: %s\n", path, strerror(errno)); return -1; }
+    atexit(exec_log_flush);
+    return 0;
+}
+
+// s as a JSON string: quotes, backslashes and control bytes escaped.
+static void json_str(FILE *f, const char *s) {
+    putc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else putc(c, f);
+    }
+    putc('"', f);
+}
+
+static double realtime_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// The first half of a record, for a process that just started. Returns a
+// malloc()ed string for exec_log_end(), or NULL when not logging.
+static char *exec_log_start(char *const argv[], pid_t pid) {
+    if (exec_log_fd < 0 || pid <= 0) return NULL;
+    if (!exec_log_cwd || exec_log_cwd_version != cwd_version) {
+        free(exec_log_cwd);
+        exec_log_cwd = getcwd(NULL, 0);
+        exec_log_cwd_version = cwd_version;
+    }
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f) return NULL;
+    fputs("{\"argv\":[", f);
+    for (int i = 0; argv[i]; i++) { if (i) putc(',', f); json_str(f, argv[i]); }
+    fputs("],\"cwd\":", f);
+    json_str(f, exec_log_cwd ? exec_log_cwd : "");
+    fprintf(f, ",\"pid\":%ld,\"start\":%.6f", (long)pid, realtime_now());
+    if (fclose(f) != 0) { free(buf); return NULL; }
+    return buf;
+}
+
+// Finish a record with how the process ended, and queue it.
+static void exec_log_end(char *start, int status, const struct rusage *ru) {
+    char end[256];
+    int n = snprintf(end, sizeof end, ",\"end\":%.6f,\"utime\":%.6f,\"stime\":%.6f,\"maxrss_kb\":%ld,\"%s\":%d}\n",
+                     realtime_now(), (double)ru->ru_utime.tv_sec + (double)ru->ru_utime.tv_usec / 1e6,
+                     (double)ru->ru_stime.tv_sec + (double)ru->ru_stime.tv_usec / 1e6, ru->ru_maxrss,
+                     WIFSIGNALED(status) ? "signal" : "exit",
+                     WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+    size_t len = strlen(start);
+    char *rec = realloc(start, len + (size_t)n + 1);
+    if (!rec) { free(start); return; }
+    memcpy(rec + len, end, (size_t)n + 1);
+    exec_log_iov[exec_log_n++] = (struct iovec){ rec, len + (size_t)n };
+    if (exec_log_n == EXEC_LOG_BATCH) exec_log_flush();
+}
+
+// ------------------Built-in commands: exit, cd, hash, set ------------------
+// Each builtin is a handler taking argv[] and returning its exit status.
+static int exit_requested; // Set by `exit`; repl() stops after the current command
+
+static int builtin_exit(char *argv[]) {
+    exit_requested = 1;
+    return argv[1] ? atoi(argv[1]) & 0xff : last_status; // `exit N`, or the last command's status
+}
+
+// ------------------ Directories: cd, pushd, popd, dirs ------------------
+// The shell keeps its current directory as text, logical_cwd (also $PWD),
+// the way the user got there: after `cd /srv/link/..` it is /srv, not the
+// parent of wherever the symlink led, and `pwd` prints it without a getcwd().
+// `cd dir` resolves "." and ".." against logical_cwd as text. A relative
+// path without ".." is then handed to chdir() as it is, so the kernel walks
+// only the new components instead of the whole path from the root, which is
+// what `cd` costs on deep NFS paths. -P (or a logical path that does not
+// work) falls back to the physical chdir() and getcwd().
+//
+// pushd keeps each directory it leaves as an O_PATH fd next to its path, so
+// popd and a plain `pushd` (swap the top two) go back with fchdir(): no path
+// lookup at all.
+#ifdef O_PATH
+#define DIR_FD_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC) // A handle only: no read permission needed
+#else
+#define DIR_FD_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+#define DIR_STACK_MAX 256
+
+struct dir_mark {
+    char *path; // Logical path, malloc()ed
+    int fd;     // Open on that directory
+};
+
+static char *logical_cwd;                        // malloc()ed; NULL if unknown (say, it was deleted)
+static struct dir_mark dir_stack[DIR_STACK_MAX]; // pushd's, top last
+static int dir_depth;
+
+// base + "/" + rel (or rel alone if absolute) with ".", ".." and double
+// slashes resolved as text, into out. Returns 0, or -1 if it is too long.
+static int path_clean(const char *base, const char *rel, char *out, size_t size) {
+    size_t n = 0;
+    const char *parts[2] = { rel[0] == '/' ? "" : base, rel };
+    for (int k = 0; k < 2; k++) {
+        for (const char *p = parts[k]; ; ) {
+            while (*p == '/') p++;
+            const char *e = p;
+            while (*e && *e != '/') e++;
+            size_t len = (size_t)(e - p);
+            if (len == 0) break;
+            if (len == 2 && p[0] == '.' && p[1] == '.') {
+                while (n > 0 && out[n-1] != '/') n--; // Drop the last "/component"
+                if (n > 0) n--;
+            } else if (len != 1 || p[0] != '.') {
+                if (n + len + 2 > size) return -1;
+                out[n++] = '/';
+                memcpy(out + n, p, len);
+                n += len;
+            }
+            p = e;
+        }
+    }
+    if (n == 0) out[n++] = '/';
+    out[n] = '\0';
+    return 0;
+}
+
+// Does path p have a ".." component?
+static int has_dotdot(const char *p) {
+    for (const char *c = p; (c = strstr(c, "..")); c += 2)
+        if ((c == p || c[-1] == '/') && (c[2] == '/' || !c[2])) return 1;
+    return 0;
+}
+
+// We are in a new directory, known as `path` (NULL: ask getcwd()).
+static void cwd_changed(const char *path) {
+    char *now = path ? strdup(path) : getcwd(NULL, 0);
+    if (logical_cwd) var_set("OLDPWD", 6, logical_cwd, -1);
+    free(logical_cwd);
+    logical_cwd = now;
+    if (now) var_set("PWD", 3, now, -1);
+    cwd_version++; // The zygote follows, see zygote_spawn()
+}
+
+// At startup: an inherited $PWD is kept if it is clean and really is ".".
+static void cwd_init(void) {
+    const char *pwd = var_get("PWD");
+    char clean[4096];
+    struct stat a, b;
+    if (pwd && pwd[0] == '/' && path_clean("", pwd, clean, sizeof clean) == 0 && strcmp(clean, pwd) == 0 &&
+        stat(pwd, &a) == 0 && stat(".", &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+        logical_cwd = strdup(pwd);
+    else
+        logical_cwd = getcwd(NULL, 0);
+    if (logical_cwd) var_set("PWD", 3, logical_cwd, 1);
+}
+
+// cd to dest, logically unless `physical`. Returns 0, or -1 with errno set.
+static int change_dir(const char *dest, int physical) {
+    char path[4096];
+    if (!physical && logical_cwd && path_clean(logical_cwd, dest, path, sizeof path) == 0) {
+        const char *walk = dest[0] != '/' && !has_dotdot(dest) ? dest : path; // See above
+        if (chdir(walk) == 0) { cwd_changed(path); return 0; }
+    }
+    if (chdir(dest) != 0) return -1;
+    cwd_changed(NULL);
+    return 0;
+}
+
+// Back to a directory pushd kept. Takes over m on success; on failure it
+// stays as it was, so the stack does not change.
+static int return_to(struct dir_mark *m) {
+    if (fchdir(m->fd) != 0) { perror("mtsh: fchdir"); return -1; }
+    cwd_changed(m->path);
+    free(m->path);
+    close(m->fd);
+    return 0;
+}
+
+// The directory we are in, as a mark for the stack. Returns 0 or -1.
+static int mark_cwd(struct dir_mark *m) {
+    m->fd = open(".", DIR_FD_FLAGS);
+    m->path = logical_cwd ? strdup(logical_cwd) : getcwd(NULL, 0);
+    if (m->fd >= 0 && m->path) return 0;
+    perror("mtsh: pushd");
+    if (m->fd >= 0) close(m->fd);
+    free(m->path);
+    return -1;
+}
+
+// cd [-L|-P] [dir|-]
+static int builtin_cd(char *argv[]) {
+    int physical = 0, i = 1;
+    for (; argv[i] && (strcmp(argv[i], "-P") == 0 || strcmp(argv[i], "-L") == 0); i++)
+        physical = argv[i][1] == 'P';
+    const char *dest = argv[i] ? argv[i] : var_get("HOME");
+    int dash = dest && strcmp(dest, "-") == 0;
+    if (dash) dest = var_get("OLDPWD");
+    if (!dest) { fprintf(stderr, "cd: %s not set\n", dash ? "OLDPWD" : "HOME"); return 1; }
+    if (change_dir(dest, physical) != 0) { fprintf(stderr, "cd: %s: %s\n", dest, strerror(errno)); return 1; }
+    if (dash && logical_cwd) puts(logical_cwd); // As in sh: show where `cd -` went
+    return 0;
+}
+
+// dirs [-c] [-p] [-v]: the stack, current directory first, $HOME as ~.
+static int builtin_dirs(char *argv[]) {
+    int per_line = 0, numbered = 0;
+    for (int i = 1; argv[i]; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            while (dir_depth > 0) { dir_depth--; free(dir_stack[dir_depth].path); close(dir_stack[dir_depth].fd); }
+        } else if (strcmp(argv[i], "-p") == 0) {
+            per_line = 1;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            per_line = numbered = 1;
+        } else {
+            fprintf(stderr, "usage: dirs [-c] [-p] [-v]\n");
+            return 2;
+        }
+        if (argv[i][1] == 'c') return 0;
+    }
+    const char *home = var_get("HOME");
+    size_t hlen = home && strcmp(home, "/") != 0 ? strlen(home) : 0;
+    for (int k = dir_depth; k >= 0; k--) {
+        const char *p = k == dir_depth ? (logical_cwd ? logical_cwd : ".") : dir_stack[k].path;
+        int tilde = hlen && strncmp(p, home, hlen) == 0 && (p[hlen] == '/' || !p[hlen]);
+        if (numbered) printf("%2d  ", dir_depth - k);
+        printf("%s%s%s", tilde ? "~" : "", tilde ? p + hlen : p, per_line || k == 0 ? "\n" : " ");
+    }
     return 0;
 }
+
+// pushd [dir]: go to dir and remember where we were; without dir, swap with the top.
+static int builtin_pushd(char *argv[]) {
+    struct dir_mark here;
+    if (argv[1] && argv[2]) { fprintf(stderr, "usage: pushd [dir]\n"); return 2; }
+    if (!argv[1] && dir_depth == 0) { fprintf(stderr, "pushd: no other directory\n"); return 1; }
+    if (argv[1] && dir_depth == DIR_STACK_MAX) { fprintf(stderr, "pushd: directory stack full\n"); return 1; }
+    if (mark_cwd(&here) < 0) return 1;
+    if (!argv[1]) {
+        if (return_to(&dir_stack[dir_depth - 1]) != 0) {
+            free(here.path);
+            close(here.fd);
+            return 1;
+        }
+        dir_stack[dir_depth - 1] = here;
+    } else {
+        if (change_dir(argv[1], 0) != 0) {
+            fprintf(stderr, "pushd: %s: %s\n", argv[1], strerror(errno));
+            free(here.path);
+            close(here.fd);
+            return 1;
+        }
+        dir_stack[dir_depth++] = here;
+    }
+    return builtin_dirs((char *[]){ "dirs", NULL });
+}
+
+// popd: back to the directory on top of the stack.
+static int builtin_popd(char *argv[]) {
+    if (argv[1]) { fprintf(stderr, "usage: popd\n"); return 2; }
+    if (dir_depth == 0) { fprintf(stderr, "popd: directory stack empty\n"); return 1; }
+    if (return_to(&dir_stack[dir_depth - 1]) != 0) return 1;
+    dir_depth--;
+    return builtin_dirs((char *[]){ "dirs", NULL });
+}
+
+// ------------------ In-process utilities: echo, printf, true, false, test/[, pwd ------------------
+// Scripts are mostly made of these. Running them here instead of exec()ing a
+// binary from /bin saves a whole process per line. They write to the stdio
+// stdout buffer, which in batch mode is only flushed every 64 KiB or before an
+// external command starts; as a pipeline stage on a worker thread, to that
+// worker's own stream instead (see "Builtin stages on threads"), hence BI_OUT.
+static _Thread_local FILE *bi_out;      // A worker's stdout stream, NULL in the shell's own thread
+static _Thread_local const int *bi_fds; // A worker's stdin, stdout and stderr, for test -t
+#define BI_OUT (bi_out ? bi_out : stdout)
+
+static int builtin_true(char *argv[])  { (void)argv; return 0; }
+static int builtin_false(char *argv[]) { (void)argv; return 1; }
+
+// Write the backslash escape starting at s[0] == '\\' to `out` and return how
+// many bytes it used. Handles the escapes of printf(1) and echo -e; \c sets *stop.
+static size_t put_escape(const char *s, int *stop, FILE *out) {
+    int c;
+    switch (s[1]) {
+    case 'a': c = '\a'; break;
+    case 'b': c = '\b'; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'v': c = '\v'; break;
+    case '\\': c = '\\'; break;
+    case 'c': *stop = 1; return 2;
+    case '0': { // \0NNN: up to three octal digits
+        size_t i = 2;
+        c = 0;
+        while (i < 5 && s[i] >= '0' && s[i] <= '7') c = c * 8 + (s[i++] - '0');
+        putc(c, out);
+        return i;
+    }
+    case '\0': putc('\\', out); return 1;
+    default: putc('\\', out); putc(s[1], out); return 2;
+    }
+    putc(c, out);
+    return 2;
+}
+
+// echo [-neE] [arg ...]
+static int builtin_echo(char *argv[]) {
+    int newline = 1, escapes = 0, i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) { // Leading option words
+        const char *o = argv[i] + 1;
+        while (*o == 'n' || *o == 'e' || *o == 'E') o++;
+        if (*o) break; // Not an option after all, e.g. "-x": print it
+        for (o = argv[i] + 1; *o; o++) {
+            if (*o == 'n') newline = 0;
+            else escapes = *o == 'e';
+        }
+    }
+    int stop = 0;
+    FILE *out = BI_OUT;
+    for (int first = 1; argv[i] && !stop; i++, first = 0) {
+        if (!first) putc(' ', out);
+        if (!escapes) { fputs(argv[i], out); continue; }
+        for (const char *s = argv[i]; *s && !stop; ) {
+            if (*s == '\\') s += put_escape(s, &stop, out);
+            else putc(*s++, out);
+        }
+    }
+    if (newline && !stop) putc('\n', out);
+    return 0;
+}
+
+// Convert a printf(1) numeric argument. 'c (a leading quote) gives the
+// character's code, as POSIX asks. Sets *bad on garbage.
+static long long printf_int(const char *s, int *bad) {
+    if (!s) return 0;
+    if (*s == '\'' || *s == '"') return (unsigned char)s[1];
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 0);
+    if (end == s || *end || errno) { fprintf(stderr, "printf: %s: invalid number\n", s); *bad = 1; }
+    return v;
+}
+
+static double printf_float(const char *s, int *bad) {
+    if (!s) return 0;
+    if (*s == '\'' || *s == '"') return (unsigned char)s[1];
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || *end) { fprintf(stderr, "printf: %s: invalid number\n", s); *bad = 1; }
+    return v;
+}
+
+// printf FORMAT [arg ...]: the format is reused until all arguments are used up.
+static int builtin_printf(char *argv[]) {
+    if (!argv[1]) { fprintf(stderr, "printf: usage: printf format [arguments]\n"); return 2; }
+    const char *fmt = argv[1];
+    char **args = argv + 2;
+    int bad = 0, stop = 0;
+    FILE *out = BI_OUT;
+    do {
+        int used = 0;
+        for (const char *f = fmt; *f && !stop; ) {
+            if (*f == '\\') { f += put_escape(f, &stop, out); continue; }
+            if (*f != '%') { putc(*f++, out); continue; }
+            if (f[1] == '%') { putc('%', out); f += 2; continue; }
+
+            // Copy "%[flags][width][.precision]" into spec, then add the conversion
+            char spec[32];
+            size_t n = 0;
+            spec[n++] = *f++;
+            while (*f && strchr("-+ #0", *f) && n < 20) spec[n++] = *f++;
+            while (*f >= '0' && *f <= '9' && n < 24) spec[n++] = *f++;
+            if (*f == '.') { spec[n++] = *f++; while (*f >= '0' && *f <= '9' && n < 28) spec[n++] = *f++; }
+            char conv = *f ? *f++ : '\0';
+            const char *arg = *args ? *args++ : NULL;
+            if (arg) used = 1;
+
+            switch (conv) {
+            case 'd': case 'i':
+                spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+                fprintf(out, spec, printf_int(arg, &bad));
+                break;
+            case 'u': case 'o': case 'x': case 'X':
+                spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+                fprintf(out, spec, (unsigned long long)printf_int(arg, &bad));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+                spec[n++] = conv; spec[n] = '\0';
+                fprintf(out, spec, printf_float(arg, &bad));
+                break;
+            case 'c':
+                spec[n++] = 'c'; spec[n] = '\0';
+                fprintf(out, spec, arg ? arg[0] : '\0');
+                break;
+            case 's':
+                spec[n++] = 's'; spec[n] = '\0';
+                fprintf(out, spec, arg ? arg : "");
+                break;
+            case 'b': // Like %s, but backslash escapes in the argument are expanded
+                for (const char *s = arg ? arg : ""; *s && !stop; ) {
+                    if (*s == '\\') s += put_escape(s, &stop, out);
+                    else putc(*s++, out);
+                }
+                break;
+            default:
+                fprintf(stderr, "printf: %%%c: invalid directive\n", conv);
+                return 1;
+            }
+        }
+        if (!used) break; // The format consumed no arguments: print it just once
+    } while (*args && !stop);
+    return bad;
+}
+
+// pwd [-L|-P]: print the current directory, as cd keeps it (-P: as the kernel has it).
+static int builtin_pwd(char *argv[]) {
+    int physical = argv[1] && strcmp(argv[1], "-P") == 0;
+    FILE *out = BI_OUT;
+    if (!physical && logical_cwd) { fprintf(out, "%s\n", logical_cwd); return 0; }
+    char buf[4096];
+    if (!getcwd(buf, sizeof buf)) { perror("pwd"); return 1; }
+    fprintf(out, "%s\n", buf);
+    return 0;
+}
+
+// --- test / [ ---
+// A small recursive-descent evaluator for the POSIX test grammar:
+//   expr  := and ( -o and )*
+//   and   := not ( -a not )*
+//   not   := ! not | ( expr ) | primary
+// Errors set t->err and make test return 2.
+struct test_state {
+    char **av; // Remaining arguments
+    int err;
+};
+
+static int test_or(struct test_state *t);
+
+static int test_unary_file(char op, const char *path) {
+    struct stat st;
+    if (op == 'h' || op == 'L') return lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+    switch (op) {
+    case 'r': return access(path, R_OK) == 0;
+    case 'w': return access(path, W_OK) == 0;
+    case 'x': return access(path, X_OK) == 0;
+    }
+    if (stat(path, &st) != 0) return 0;
+    switch (op) {
+    case 'e': return 1;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    }
+    return 0;
+}
+
+static long long test_int(struct test_state *t, const char *s) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (end == s || *end || errno) { fprintf(stderr, "test: %s: integer expression expected\n", s); t->err = 1; }
+    return v;
+}
+
+static int test_primary(struct test_state *t) {
+    char **av = t->av;
+    if (!av[0]) { t->err = 1; return 0; }
+
+    // Binary operators: a OP b
+    if (av[1] && av[2]) {
+        const char *op = av[1];
+        int r = -1;
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) r = strcmp(av[0], av[2]) == 0;
+        else if (strcmp(op, "!=") == 0) r = strcmp(av[0], av[2]) != 0;
+        else if (op[0] == '-' && strlen(op) == 3) {
+            static const char *const ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+            for (int i = 0; i < 6 && r < 0; i++) {
+                if (strcmp(op, ops[i]) != 0) continue;
+                long long a = test_int(t, av[0]), b = test_int(t, av[2]);
+                switch (i) {
+                case 0: r = a == b; break;
+                case 1: r = a != b; break;
+                case 2: r = a <  b; break;
+                case 3: r = a <= b; break;
+                case 4: r = a >  b; break;
+                case 5: r = a >= b; break;
+                }
+            }
+        }
+        if (r >= 0) { t->av += 3; return r; }
+    }
+
+    // Unary operators: -OP arg
+    if (av[0][0] == '-' && av[0][1] && !av[0][2] && av[1]) {
+        char op = av[0][1];
+        int r = -1;
+        if (op == 'z') r = av[1][0] == '\0';
+        else if (op == 'n') r = av[1][0] != '\0';
+        else if (op == 't') { // On a worker thread, its own stdin, stdout and stderr
+            int fd = atoi(av[1]);
+            r = isatty(bi_fds && fd >= 0 && fd <= 2 ? bi_fds[fd] : fd);
+        }
+        else if (strchr("efdrwxshLpSbcug", op)) r = test_unary_file(op, av[1]);
+        if (r >= 0) { t->av += 2; return r; }
+    }
+
+    // A lone string: true if not empty
+    t->av += 1;
+    return av[0][0] != '\0';
+}
+
+static int test_not(struct test_state *t) {
+    if (t->av[0] && strcmp(t->av[0], "!") == 0 && t->av[1]) { t->av++; return !test_not(t); }
+    if (t->av[0] && strcmp(t->av[0], "(") == 0 && t->av[1]) {
+        t->av++;
+        int r = test_or(t);
+        if (!t->av[0] || strcmp(t->av[0], ")") != 0) { fprintf(stderr, "test: missing ')'\n"); t->err = 1; }
+        else t->av++;
+        return r;
+    }
+    return test_primary(t);
+}
+
+static int test_and(struct test_state *t) {
+    int r = test_not(t);
+    while (!t->err && t->av[0] && strcmp(t->av[0], "-a") == 0) { t->av++; r = test_not(t) && r; }
+    return r;
+}
+
+static int test_or(struct test_state *t) {
+    int r = test_and(t);
+    while (!t->err && t->av[0] && strcmp(t->av[0], "-o") == 0) { t->av++; r = test_and(t) || r; }
+    return r;
+}
+
+// test EXPR, or [ EXPR ]
+static int builtin_test(char *argv[]) {
+    int argc = 0;
+    while (argv[argc]) argc++;
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc-1], "]") != 0) { fprintf(stderr, "[: missing ']'\n"); return 2; }
+        argv[--argc] = NULL; // Drop the "]"
+    }
+    if (argc == 1) return 1; // No expression is false
+    struct test_state t = { argv + 1, 0 };
+    int r = test_or(&t);
+    if (!t.err && t.av[0]) { fprintf(stderr, "test: %s: unexpected argument\n", t.av[0]); t.err = 1; }
+    return t.err ? 2 : !r;
+}
+
+// ------------------ Builtin registry ------------------
+// Lookup is one switch on the name's length, first and last byte, followed by a
+// single strcmp() to confirm, so it costs the same whether there are 4 builtins
+// or 40. To add a builtin: add it to the enum and the table, and add its case to
+// find_builtin(). Two names with the same key make the compiler reject the
+// duplicate case label, so a collision cannot slip in unnoticed.
+static int builtin_jobs(char *argv[]); // Job control builtins live with the job table, see below
+static int builtin_wait(char *argv[]);
+static int builtin_fg(char *argv[]);
+static int builtin_parallel(char *argv[]);
+static int builtin_history(char *argv[]);
+static int builtin_memo(char *argv[]);
+
+// Every builtin runs in the shell when it is a command of its own, and in a
+// forked copy of the shell as a pipeline stage (so `cd /tmp | cat` changes
+// nothing), unless it has this flag:
+enum builtin_flags {
+    BI_THREADED = 1 << 0, // Touches nothing but argv and BI_OUT: a pipeline stage may run it on a thread
+};
+
+struct builtin {
+    const char *name;
+    int (*fn)(char *argv[]);
+    unsigned flags;
+};
+
+enum { BI_CD, BI_EXIT, BI_HASH, BI_SET, BI_ECHO, BI_PRINTF, BI_TRUE, BI_FALSE,
+       BI_TEST, BI_BRACKET, BI_PWD, BI_JOBS, BI_WAIT, BI_FG,
+       BI_PARALLEL, BI_EXPORT, BI_UNSET, BI_HISTORY, BI_MEMO, BI_STATS,
+       BI_PUSHD, BI_POPD, BI_DIRS };
+
+static const struct builtin builtins[] = {
+    [BI_CD]      = { "cd",     builtin_cd,     0 },
+    [BI_EXIT]    = { "exit",   builtin_exit,   0 },
+    [BI_HASH]    = { "hash",   builtin_hash,   0 },
+    [BI_SET]     = { "set",    builtin_set,    0 },
+    [BI_ECHO]    = { "echo",   builtin_echo,   BI_THREADED },
+    [BI_PRINTF]  = { "printf", builtin_printf, BI_THREADED },
+    [BI_TRUE]    = { "true",   builtin_true,   BI_THREADED },
+    [BI_FALSE]   = { "false",  builtin_false,  BI_THREADED },
+    [BI_TEST]    = { "test",   builtin_test,   BI_THREADED },
+    [BI_BRACKET] = { "[",      builtin_test,   BI_THREADED },
+    [BI_PWD]     = { "pwd",    builtin_pwd,    BI_THREADED },
+    [BI_JOBS]    = { "jobs",   builtin_jobs,   0 },
+    [BI_WAIT]    = { "wait",   builtin_wait,   0 },
+    [BI_FG]      = { "fg",     builtin_fg,     0 },
+    [BI_PARALLEL] = { "parallel", builtin_parallel, 0 },
+    [BI_EXPORT]  = { "export", builtin_export, 0 },
+    [BI_UNSET]   = { "unset",  builtin_unset,  0 },
+    [BI_HISTORY] = { "history", builtin_history, 0 },
+    [BI_MEMO]    = { "memo",   builtin_memo,   0 },
+    [BI_STATS]   = { "stats",  builtin_stats,  0 },
+    [BI_PUSHD]   = { "pushd",  builtin_pushd,  0 },
+    [BI_POPD]    = { "popd",   builtin_popd,   0 },
+    [BI_DIRS]    = { "dirs",   builtin_dirs,   0 },
+};
+
+#define BI_KEY(len, first, last) (((unsigned)(len) << 16) | ((unsigned)(unsigned char)(first) << 8) | (unsigned char)(last))
+
+static const struct builtin *find_builtin(const char *name) {
+    size_t len = strnlen(name, 16); // No builtin name is that long
+    if (len == 0 || len == 16) return NULL;
+    int i;
+    switch (BI_KEY(len, name[0], name[len-1])) {
+    case BI_KEY(2, 'c', 'd'): i = BI_CD;   break;
+    case BI_KEY(4, 'e', 't'): i = BI_EXIT; break;
+    case BI_KEY(4, 'h', 'h'): i = BI_HASH; break;
+    case BI_KEY(3, 's', 't'): i = BI_SET;  break;
+    case BI_KEY(4, 'e', 'o'): i = BI_ECHO; break;
+    case BI_KEY(6, 'p', 'f'): i = BI_PRINTF; break;
+    case BI_KEY(4, 't', 'e'): i = BI_TRUE; break;
+    case BI_KEY(5, 'f', 'e'): i = BI_FALSE; break;
+    case BI_KEY(4, 't', 't'): i = BI_TEST; break;
+    case BI_KEY(1, '[', '['): i = BI_BRACKET; break;
+    case BI_KEY(3, 'p', 'd'): i = BI_PWD;  break;
+    case BI_KEY(4, 'j', 's'): i = BI_JOBS; break;
+    case BI_KEY(4, 'w', 't'): i = BI_WAIT; break;
+    case BI_KEY(2, 'f', 'g'): i = BI_FG;   break;
+    case BI_KEY(8, 'p', 'l'): i = BI_PARALLEL; break;
+    case BI_KEY(6, 'e', 't'): i = BI_EXPORT; break;
+    case BI_KEY(5, 'u', 't'): i = BI_UNSET; break;
+    case BI_KEY(7, 'h', 'y'): i = BI_HISTORY; break;
+    case BI_KEY(4, 'm', 'o'): i = BI_MEMO; break;
+    case BI_KEY(5, 's', 's'): i = BI_STATS; break;
+    case BI_KEY(5, 'p', 'd'): i = BI_PUSHD; break;
+    case BI_KEY(4, 'p', 'd'): i = BI_POPD; break;
+    case BI_KEY(4, 'd', 's'): i = BI_DIRS; break;
+    default: return NULL;
+    }
+    return strcmp(builtins[i].name, name) == 0 ? &builtins[i] : NULL;
+}
+
+// Run argv[] if it names a builtin. Returns 1 if it did (last_status is set), else 0.
+// Redirections are applied to the shell itself for the duration of the call
+// and undone afterwards, see apply_redirs().
+static int try_builtin(char *argv[], const struct redir *rd, int nredirs) {
+    if (!argv[0]) return 1; // Nothing to do, returns 1 meaning command is handled. 
+    const struct builtin *b = find_builtin(argv[0]);
+    if (!b) return 0; // Not a builtin
+    uint64_t t0 = now_ns();
+    if (nredirs == 0) {
+        last_status = b->fn(argv);
+        uint64_t ns = now_ns() - t0;
+        lat_add(&phases[PH_BUILTIN], ns);
+        cmd_stat_add(argv[0], ns);
+        return 1;
+    }
+
+    struct saved_fd *save = arena_alloc(&arena, (size_t)nredirs * sizeof *save);
+    if (!save) { perror("mtsh"); last_status = 1; return 1; }
+    int nsaved = 0;
+    fflush(stdout); // Pending output belongs to the old stdout
+    if (apply_redirs(rd, nredirs, save, &nsaved) == 0) last_status = b->fn(argv);
+    else last_status = 1;
+    fflush(stdout);
+    restore_redirs(save, nsaved);
+    uint64_t ns = now_ns() - t0;
+    lat_add(&phases[PH_BUILTIN], ns);
+    cmd_stat_add(argv[0], ns);
+    return 1; // handled
+}
+
+// ------------------ Passing file descriptors over Unix sockets ------------------
+// A process can hand open files to another one over a Unix socket: the fds
+// travel as SCM_RIGHTS "ancillary data" next to ordinary bytes, and arrive
+// as new fds in the receiver that refer to the same open files.
+// Used by the zygote (below) and by the command server (--serve).
+#define MAX_PASSED_FDS 64 // Per message; the kernel allows 253
+
+static int write_all(int fd, const void *buf, size_t n) {
+    for (const char *p = buf; n > 0; ) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t n) {
+    for (char *p = buf; n > 0; ) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        n -= (size_t)r;
+    }
+    return 0;
+}
+
+// Send the len bytes at hdr with nfds fds attached. Returns 0 or -1.
+static int send_fds(int s, const void *hdr, size_t len, const int *fds, int nfds) {
+    union { struct cmsghdr h; char space[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))]; } ctl;
+    struct iovec iov = { (void *)hdr, len };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0) {
+        memset(&ctl, 0, sizeof ctl);
+        msg.msg_control = ctl.space;
+        msg.msg_controllen = CMSG_SPACE((size_t)nfds * sizeof(int));
+        struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+        h->cmsg_level = SOL_SOCKET;
+        h->cmsg_type = SCM_RIGHTS;
+        h->cmsg_len = CMSG_LEN((size_t)nfds * sizeof(int));
+        memcpy(CMSG_DATA(h), fds, (size_t)nfds * sizeof(int));
+    }
+    ssize_t r;
+    do r = sendmsg(s, &msg, MSG_NOSIGNAL); while (r < 0 && errno == EINTR);
+    if (r >= 0 && (size_t)r < len) return write_all(s, (const char *)hdr + r, len - (size_t)r);
+    return r < 0 ? -1 : 0;
+}
+
+// Receive exactly len bytes into hdr, and up to maxfds fds (close-on-exec)
+// into fds[]. Returns the number of fds, or -1 on EOF or error.
+static int recv_fds(int s, void *hdr, size_t len, int *fds, int maxfds) {
+    union { struct cmsghdr h; char space[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))]; } ctl;
+    struct iovec iov = { hdr, len };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof ctl.space;
+    ssize_t r;
+    do r = recvmsg(s, &msg, 0); while (r < 0 && errno == EINTR);
+    if (r <= 0) return -1;
+
+    int nfds = 0;
+    for (struct cmsghdr *h = CMSG_FIRSTHDR(&msg); h; h = CMSG_NXTHDR(&msg, h)) {
+        if (h->cmsg_level != SOL_SOCKET || h->cmsg_type != SCM_RIGHTS) continue;
+        int n = (int)((h->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(h) + (size_t)i * sizeof(int), sizeof fd);
+            if (nfds < maxfds) { fcntl(fd, F_SETFD, FD_CLOEXEC); fds[nfds++] = fd; }
+            else close(fd); // More than asked for: not ours to keep
+        }
+    }
+    if ((size_t)r < len && read_all(s, (char *)hdr + r, len - (size_t)r) < 0) {
+        while (nfds > 0) close(fds[--nfds]);
+        return -1;
+    }
+    return nfds;
+}
+
+// ------------------ Placement: pin, numa and nice in front of a command ------------------
+//   pin CPUS cmd ...             run on these CPUs only ("0-3,8"), like taskset -c
+//   numa --node N cmd ...        on node N's CPUs, with memory from node N only
+//   numa --membind N cmd ...     memory from node N, any CPU
+//   nice [-n N] cmd ...          N (default 10) added to the niceness
+// Like `timeout`, these are prefixes that run_pipeline() takes off argv, and
+// they combine: `pin 2 nice -n 5 make`. The shell applies them itself in the
+// child, between fork() and exec(), so there is no taskset or numactl to
+// exec first. posix_spawn() has no hook for that, so a placed command is
+// started with fork() in either build. Affinity and memory policy are Linux
+// calls; elsewhere pin and numa say so and fail with 126.
+struct placement {
+    int set;          // Anything to do at all
+    int nice;         // Added to the niceness
+#ifdef __linux__
+    int has_cpus;
+    cpu_set_t cpus;
+    int has_node;
+    int node;         // Bind memory to this NUMA node
+#endif
+};
+
+static struct placement spawn_place; // For the command being started, reset after
+
+#ifdef __linux__
+#ifndef MPOL_BIND
+#define MPOL_BIND 2 // From <linux/mempolicy.h>
+#endif
+
+// "0-3,8,10-11" into *set. Returns 0, or -1 if it is not a CPU list.
+static int parse_cpus(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    for (;;) {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0) return -1;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo) return -1;
+        }
+        if (hi >= CPU_SETSIZE) return -1;
+        for (long c = lo; c <= hi; c++) CPU_SET((int)c, set);
+        if (*end == '\0') return 0;
+        if (*end != ',') return -1;
+        s = end + 1;
+    }
+}
+
+// The CPUs of NUMA node `node`, from sysfs. Returns 0, or -1 if there is no such node.
+static int node_cpus(int node, cpu_set_t *set) {
+    char path[64], list[4096];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, list, sizeof list - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    list[n] = '\0';
+    if (list[n-1] == '\n') list[n-1] = '\0';
+    if (list[0] == '\0') { CPU_ZERO(set); return 0; } // A node with memory only
+    return parse_cpus(list, set);
+}
+
+// Keep only the CPUs we may run on; an empty set is an error, reported here.
+static int usable_cpus(const char *what, cpu_set_t *set) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed) == 0) CPU_AND(set, set, &allowed);
+    if (CPU_COUNT(set) > 0) return 0;
+    fprintf(stderr, "%s: none of these CPUs is available\n", what);
+    return -1;
+}
+#endif
+
+// If *argvp starts with pin, numa or nice, move it past that and add it to
+// *pl. Returns 1 if it took a prefix, 0 if there is none, -1 after a message.
+static int place_prefix(char ***argvp, struct placement *pl) {
+    char **argv = *argvp;
+    if (!argv[0]) return 0;
+    int pin = strcmp(argv[0], "pin") == 0, numa = strcmp(argv[0], "numa") == 0;
+    if (strcmp(argv[0], "nice") == 0) {
+        int i = 1, n = 10;
+        if (argv[1] && strncmp(argv[1], "-n", 2) == 0) {
+            const char *v = argv[1][2] ? argv[1] + 2 : argv[i = 2];
+            char *end;
+            long l = v ? strtol(v, &end, 10) : 0;
+            if (!v || end == v || *end || l < -40 || l > 40) goto usage;
+            n = (int)l;
+            i++;
+        }
+        if (!argv[i]) goto usage;
+        pl->nice += n;
+        pl->set = 1;
+        *argvp = &argv[i];
+        return 1;
+    }
+    if (!pin && !numa) return 0;
+#ifdef __linux__
+    if (pin) {
+        if (!argv[1] || !argv[2] || parse_cpus(argv[1], &pl->cpus) < 0) goto usage;
+        if (usable_cpus("mtsh: pin", &pl->cpus) < 0) return -1;
+        pl->has_cpus = pl->set = 1;
+        *argvp = &argv[2];
+        return 1;
+    }
+    int cpus_too = argv[1] && strcmp(argv[1], "--node") == 0;
+    char *end;
+    long node = argv[1] && argv[2] ? strtol(argv[2], &end, 10) : -1;
+    if ((!cpus_too && (!argv[1] || strcmp(argv[1], "--membind") != 0)) ||
+        node < 0 || *end || node >= 1024 || !argv[3]) goto usage;
+    cpu_set_t cpus;
+    if (node_cpus((int)node, &cpus) < 0) { fprintf(stderr, "mtsh: numa: no node %ld\n", node); return -1; }
+    if (cpus_too) {
+        if (usable_cpus("mtsh: numa", &cpus) < 0) return -1;
+        pl->cpus = cpus;
+        pl->has_cpus = 1;
+    }
+    pl->node = (int)node;
+    pl->has_node = pl->set = 1;
+    *argvp = &argv[3];
+    return 1;
+#else
+    fprintf(stderr, "mtsh: %s: not supported on this system\n", argv[0]);
+    return -1;
+#endif
+usage:
+    if (pin) fprintf(stderr, "usage: pin CPUS cmd [args...]   (CPUS like 0-3,8)\n");
+    else if (numa) fprintf(stderr, "usage: numa --node N | --membind N cmd [args...]\n");
+    else fprintf(stderr, "usage: nice [-n N] cmd [args...]\n");
+    return -1;
+}
+
+// In the child, before exec: apply *pl to ourselves. A niceness we may not
+// have (below 0 without privileges) is a warning, as with nice(1).
+static void place_apply(const struct placement *pl) {
+    if (pl->nice) {
+        errno = 0;
+        int prio = getpriority(PRIO_PROCESS, 0);
+        if (errno == 0 && setpriority(PRIO_PROCESS, 0, prio + pl->nice) < 0) perror("mtsh: nice");
+    }
+#ifdef __linux__
+    if (pl->has_cpus && sched_setaffinity(0, sizeof pl->cpus, &pl->cpus) < 0) {
+        perror("mtsh: pin");
+        _exit(126);
+    }
+    if (pl->has_node) {
+        unsigned long mask[1024 / (8 * sizeof(unsigned long))] = { 0 };
+        mask[pl->node / (8 * sizeof *mask)] |= 1UL << (pl->node % (8 * sizeof *mask));
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, mask, (unsigned long)(8 * sizeof mask)) < 0) {
+            perror("mtsh: numa");
+            _exit(126);
+        }
+    }
+#endif
+}
+
+// ------------------ Spawn backends: posix_spawn (default) or fork ------------------
+// The backend is picked at build time, see the Makefile:
+//   make               -> posix_spawn(), which glibc and musl implement with
+//                         vfork/CLONE_VM semantics: no page tables are copied.
+//   make SPAWN=fork    -> classic fork() + execv(), kept as a fallback.
+// spawn_path() starts the already resolved executable `path` with stdin/stdout
+// connected to in_fd/out_fd (pipeline ends, or 0/1) and the stage's
+// redirections applied on top, and returns 0 with *pidp set, or an error number.
+// Commands with a placement (see above) always go through fork_path().
+static int spawn_pgroup; // Set while a `timeout` command starts: it leads a process group of its own
+
+static int fork_path(pid_t *pidp, const char *path, const struct stage *st, int in_fd, int out_fd);
+
+#ifndef MTSH_SPAWN_FORK
+static int spawn_path(pid_t *pidp, const char *path, const struct stage *st,
+                      int in_fd, int out_fd) {
+    if (spawn_place.set) return fork_path(pidp, path, st, in_fd, out_fd); // Needs code in the child
+    // The child-side work (pipe ends, redirections) is described up front as a
+    // list of "file actions" that posix_spawn performs in the child right before exec.
+    posix_spawn_file_actions_t fa;
+    int err = posix_spawn_file_actions_init(&fa);
+    if (err != 0) return err;
+    if (in_fd != STDIN_FILENO)
+        err = posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+    if (err == 0 && out_fd != STDOUT_FILENO)
+        err = posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+    for (int i = 0; err == 0 && i < st->nredirs; i++) {
+        const struct redir *r = &st->redirs[i];
+        if (r->op != R_DUP)
+            err = posix_spawn_file_actions_addopen(&fa, r->fd, r->target, redir_flags[r->op], 0644);
+        else if (r->dupfd < 0)
+            err = posix_spawn_file_actions_addclose(&fa, r->fd);
+        else if (r->dupfd != r->fd)
+            err = posix_spawn_file_actions_adddup2(&fa, r->dupfd, r->fd);
+    }
+    posix_spawnattr_t attr, *ap = NULL;
+    if (err == 0 && spawn_pgroup && (err = posix_spawnattr_init(&attr)) == 0) {
+        ap = &attr; // A process group of its own (pgroup 0: its own PID), for `timeout`
+        err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        if (err == 0) err = posix_spawnattr_setpgroup(&attr, 0);
+    }
+    if (err == 0)
+        err = posix_spawn(pidp, path, &fa, ap, st->argv, environ);
+    if (ap) posix_spawnattr_destroy(ap);
+    posix_spawn_file_actions_destroy(&fa);
+    n_spawned += err == 0;
+    // Pipe fds are close-on-exec, so the child keeps only the dup2()ed copies.
+    // Unlike fork+exec, failures (cannot exec, cannot open a redirection) come
+    // back here as an error number instead of an exit code from the child.
+    return err;
+}
+#endif
+
+static int fork_path(pid_t *pidp, const char *path, const struct stage *st,
+                     int in_fd, int out_fd) {
+    pid_t pid = fork(); // Create a new process,
+    n_forked += pid > 0; // For `stats`
+    // pid_t is the process ID type from <sys/types.h> via <unistd.h>.
+    // This is usually just an int, but it's good practice to use the type defined by the system.
+
+    // In a way, the fork() is the punch line of the whole thing:
+    // fork() creates a new process that is a copy of the current process,
+    // after the fork there are two processes running the same code.
+    // - If fork() returns a negative value, it means an error occurred.
+    // - If fork() returns 0, we are in the child process (the new one).
+    // - If fork() returns a positive value, we are in the parent (original) process, and
+    //   the return value is the PID of the child process.
+    // The child process will execute the command, while the parent will wait for it to finish.
+    if (pid < 0) return errno; // Fork failed, error
+    if (pid == 0) { // We are in the child (new) process
+        // Set up signal handling for child process (optional, not implemented here)
+        if (spawn_pgroup) setpgid(0, 0); // A process group of its own, for `timeout`
+        place_apply(&spawn_place);       // pin, numa, nice
+
+        // Pipes: connect this stage to its neighbours. The pipe fds themselves
+        // are close-on-exec, so only the dup2()ed copies survive execv().
+        if (in_fd != STDIN_FILENO && dup2(in_fd, STDIN_FILENO) < 0) { perror("mtsh: dup2 stdin"); _exit(1); }
+        if (out_fd != STDOUT_FILENO && dup2(out_fd, STDOUT_FILENO) < 0) { perror("mtsh: dup2 stdout"); _exit(1); }
+
+        // Redirections (<, >, >>, 2>&1, ...), already parsed by the tokenizer.
+        // _exit(), not exit(): the stdio buffers we inherited belong to the parent.
+        if (apply_redirs(st->redirs, st->nredirs, NULL, NULL) < 0) _exit(1);
+
+        // ------------------ Execute command ------------------
+        // The PATH search already happened in the parent (see path_lookup()),
+        // so execv() gets the full path and makes exactly one execve() call.
+        execv(path, st->argv); // Execute the command. execv() does not return on success,
+        // it replaces the current process image with a new one.
+        // If execv() returns, it means there was an error
+        perror(st->argv[0]);   // only reached on error
+        _exit(127); // Exit child with error code 127 (command not found)
+    }
+    if (spawn_pgroup) setpgid(pid, pid); // Also here: whichever runs first, it is done before exec
+    *pidp = pid; // pid > 0, we are in the parent process
+    return 0;
+}
+
+#ifdef MTSH_SPAWN_FORK
+static int spawn_path(pid_t *pidp, const char *path, const struct stage *st,
+                      int in_fd, int out_fd) {
+    return fork_path(pidp, path, st, in_fd, out_fd);
+}
+#endif
+
+// ------------------ Zygote: a small helper process that does the forking ------------------
+// mtsh --zygote ... forks a helper right at startup, while the shell is still
+// small, and from then on asks it to start every external command: over a
+// socketpair the shell sends the path, argv, redirections and the fds the
+// command needs (its stdin/stdout/stderr as the shell sees them at that
+// moment), plus the working directory and environment whenever those changed.
+// The helper forks its own tiny address space instead of the shell's, so
+// starting a command costs the same however big the session grows. With the
+// fork backend that is the whole point; posix_spawn() already avoids copying
+// page tables, but still walks the shell's memory mappings.
+//
+// The helper creates the command with clone(CLONE_PARENT), which makes it a
+// child of the shell rather than of the helper: the shell's wait4(), job table
+// and `time` see it just like a command it started itself. That is Linux-only,
+// so elsewhere --zygote just prints a note. Forked subshells (a builtin in a
+// pipeline, `a && b &`, requests of --serve) spawn directly: processes the
+// helper starts would become children of the main shell, not theirs.
+//
+// Request: struct zygote_req with the fds attached, then `len` bytes:
+//   int32 target[nfds]   where each passed fd goes in the command (-1: fchdir() to it)
+//   uint32 argc, path, argv...      NUL-terminated strings
+//   uint32 nredirs, (int32 fd, int32 dupfd, uint8 op, target)...
+//   [if ZY_ENV] uint32 envc, strings...
+// Reply: int32 PID, or -errno.
+static int zygote_fd = -1; // Our end of the socketpair, -1 when not in use
+static unsigned zygote_cwd_version, zygote_env_version; // What the helper has
+
+enum { ZY_ENV = 1 };
+struct zygote_req {
+    uint32_t len;   // Bytes that follow
+    uint16_t nfds;  // Attached fds
+    uint16_t flags; // ZY_*
+};
+
+// Subshells must not use the helper, see above.
+static void zygote_detach(void) {
+    if (zygote_fd >= 0) close(zygote_fd);
+    zygote_fd = -1;
+}
+
+#ifdef __linux__
+struct zbuf { char *p; size_t len, cap; }; // Request being built, in the arena
+
+static int zput(struct zbuf *b, const void *data, size_t n) {
+    if (arena_grow((void **)&b->p, &b->cap, b->len + n, 1) < 0) return -1;
+    memcpy(b->p + b->len, data, n);
+    b->len += n;
+    return 0;
+}
+
+static int zput_u32(struct zbuf *b, uint32_t v) { return zput(b, &v, sizeof v); }
+static int zput_str(struct zbuf *b, const char *s) { return zput(b, s, strlen(s) + 1); }
+
+struct zreader { const char *p, *end; }; // Request being parsed
+
+static int zget(struct zreader *r, void *out, size_t n) {
+    if ((size_t)(r->end - r->p) < n) return -1;
+    memcpy(out, r->p, n);
+    r->p += n;
+    return 0;
+}
+
+static const char *zget_str(struct zreader *r) {
+    const char *s = r->p, *nul = memchr(s, '\0', (size_t)(r->end - s));
+    if (!nul) return NULL;
+    r->p = nul + 1;
+    return s;
+}
+
+// The helper's side: serve requests until the shell closes its end.
+static void zygote_main(int s) {
+    char *buf = NULL;
+    size_t cap = 0;
+    char *envbuf = NULL;  // The environment the shell sent last, and its array
+    char **envv = NULL;
+    for (;;) {
+        struct zygote_req req;
+        int fds[MAX_PASSED_FDS];
+        int nfds = recv_fds(s, &req, sizeof req, fds, MAX_PASSED_FDS);
+        if (nfds < 0) _exit(0); // The shell is gone
+        int32_t reply = -EPROTO;
+        if (req.len + 1 > cap) {
+            free(buf);
+            cap = req.len + 1;
+            if (!(buf = malloc(cap))) _exit(1);
+        }
+        if (read_all(s, buf, req.len) < 0) _exit(0);
+        arena_reset(&arena);
+
+        struct zreader r = { buf, buf + req.len };
+        int32_t *target = arena_alloc(&arena, (size_t)(nfds + 1) * sizeof *target);
+        uint32_t argc = 0, nredirs = 0, envc = 0;
+        const char *path = NULL;
+        char **argv = NULL;
+        struct redir *rd = NULL;
+        if (!target || nfds != req.nfds || zget(&r, target, (size_t)nfds * sizeof *target) < 0) goto done;
+        if (zget(&r, &argc, sizeof argc) < 0 || !(path = zget_str(&r))) goto done;
+        if (!(argv = arena_alloc(&arena, ((size_t)argc + 1) * sizeof *argv))) goto done;
+        for (uint32_t i = 0; i < argc; i++) if (!(argv[i] = (char *)zget_str(&r))) goto done;
+        argv[argc] = NULL;
+        if (zget(&r, &nredirs, sizeof nredirs) < 0) goto done;
+        if (!(rd = arena_alloc(&arena, ((size_t)nredirs + 1) * sizeof *rd))) goto done;
+        for (uint32_t i = 0; i < nredirs; i++) {
+            int32_t fd, dupfd;
+            unsigned char op;
+            if (zget(&r, &fd, sizeof fd) < 0 || zget(&r, &dupfd, sizeof dupfd) < 0 ||
+                zget(&r, &op, sizeof op) < 0 || op > R_DUP) goto done;
+            rd[i] = (struct redir){ fd, op, dupfd, NULL };
+            if (op != R_DUP && !(rd[i].target = zget_str(&r))) goto done;
+        }
+        if (req.flags & ZY_ENV) { // A new environment: keep it for all later commands
+            if (zget(&r, &envc, sizeof envc) < 0) goto done;
+            size_t size = (size_t)(r.end - r.p);
+            char *nb = malloc(size ? size : 1);
+            char **nv = malloc(((size_t)envc + 1) * sizeof *nv);
+            if (!nb || !nv) { free(nb); free(nv); reply = -ENOMEM; goto done; }
+            memcpy(nb, r.p, size);
+            struct zreader er = { nb, nb + size };
+            for (uint32_t i = 0; i < envc; i++) if (!(nv[i] = (char *)zget_str(&er))) { nv[i] = NULL; break; }
+            nv[envc] = NULL;
+            free(envbuf);
+            free(envv);
+            envbuf = nb;
+            environ = envv = nv;
+        }
+        for (int i = 0; i < nfds; i++) // A new working directory: move there for good
+            if (target[i] == -1 && fchdir(fds[i]) < 0) { reply = -errno; goto done; }
+
+        // clone(CLONE_PARENT) returns twice like fork(), but the new process
+        // is a sibling of ours: a child of the shell.
+        pid_t pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+        if (pid == 0) {
+            // Move what we got above every fd the command may want, then put
+            // each one where it belongs, as the fork backend does with pipe ends.
+            for (int i = 0; i < nfds; i++) {
+                if (target[i] < 0) continue;
+                int fd = fcntl(fds[i], F_DUPFD_CLOEXEC, MAX_PASSED_FDS + 1024);
+                if (fd < 0 || dup2(fd, target[i]) < 0) { perror("mtsh: zygote"); _exit(1); }
+            }
+            if (apply_redirs(rd, (int)nredirs, NULL, NULL) < 0) _exit(1);
+            execv(path, argv);
+            perror(argv[0]);
+            _exit(127);
+        }
+        reply = pid < 0 ? -errno : pid;
+    done:
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        if (write_all(s, &reply, sizeof reply) < 0) _exit(0);
+    }
+}
+
+// Start the helper. Call it early: the helper is a copy of the shell as it is now.
+static void zygote_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) { perror("mtsh: zygote"); return; }
+    fflush(NULL);
+    pid_t pid = fork();
+    n_forked += pid > 0; // For `stats`
+    if (pid < 0) { perror("mtsh: zygote"); close(sv[0]); close(sv[1]); return; }
+    if (pid == 0) {
+        close(sv[0]);
+        fcntl(sv[1], F_SETFD, FD_CLOEXEC); // Commands must not inherit it
+        zygote_main(sv[1]);
+    }
+    close(sv[1]);
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    zygote_fd = sv[0];
+    zygote_cwd_version = cwd_version;
+    zygote_env_version = env_version;
+}
+
+// Ask the helper to start `path`, like spawn_path(). Returns 0 with *pidp
+// set, an error number, or -1 if the helper is unusable (the caller then
+// spawns directly).
+static int zygote_spawn(pid_t *pidp, const char *path, const struct stage *st,
+                        int in_fd, int out_fd) {
+    int fds[MAX_PASSED_FDS];
+    int32_t target[MAX_PASSED_FDS];
+    int nfds = 0, cwd = -1;
+    struct zbuf b = { 0 };
+    struct zygote_req req = { 0 };
+
+    // The command's 0, 1 and 2, then any other fd a >&N redirection copies.
+    fds[0] = in_fd; fds[1] = out_fd; fds[2] = STDERR_FILENO;
+    target[0] = 0; target[1] = 1; target[2] = 2;
+    nfds = 3;
+    for (int i = 0; i < st->nredirs; i++) {
+        int d = st->redirs[i].dupfd;
+        if (st->redirs[i].op != R_DUP || d <= 2 || fcntl(d, F_GETFD) < 0) continue;
+        if (nfds == MAX_PASSED_FDS - 1) return -1;
+        fds[nfds] = d;
+        target[nfds++] = d;
+    }
+    if (zygote_cwd_version != cwd_version) {
+        if ((cwd = open(".", O_RDONLY | O_CLOEXEC)) < 0) return -1;
+        fds[nfds] = cwd;
+        target[nfds++] = -1;
+    }
+
+    int argc = 0;
+    while (st->argv[argc]) argc++;
+    int err = zput(&b, target, (size_t)nfds * sizeof *target) | zput_u32(&b, (uint32_t)argc) | zput_str(&b, path);
+    for (int i = 0; i < argc; i++) err |= zput_str(&b, st->argv[i]);
+    err |= zput_u32(&b, (uint32_t)st->nredirs);
+    for (int i = 0; i < st->nredirs; i++) {
+        const struct redir *r = &st->redirs[i];
+        int32_t fd = r->fd, dupfd = r->dupfd;
+        err |= zput(&b, &fd, sizeof fd) | zput(&b, &dupfd, sizeof dupfd) | zput(&b, &r->op, 1);
+        if (r->op != R_DUP) err |= zput_str(&b, r->target);
+    }
+    if (zygote_env_version != env_version) {
+        req.flags |= ZY_ENV;
+        uint32_t envc = 0;
+        while (environ[envc]) envc++;
+        err |= zput_u32(&b, envc);
+        for (uint32_t i = 0; i < envc; i++) err |= zput_str(&b, environ[i]);
+    }
+    req.len = (uint32_t)b.len;
+    req.nfds = (uint16_t)nfds;
+
+    int32_t reply;
+    if (err || send_fds(zygote_fd, &req, sizeof req, fds, nfds) < 0 ||
+        write_all(zygote_fd, b.p, b.len) < 0 || read_all(zygote_fd, &reply, sizeof reply) < 0) {
+        if (cwd >= 0) close(cwd);
+        fprintf(stderr, "mtsh: zygote not responding, starting commands directly\n");
+        zygote_detach();
+        return -1;
+    }
+    if (cwd >= 0) close(cwd);
+    zygote_cwd_version = cwd_version;
+    zygote_env_version = env_version;
+    if (reply < 0) return -reply;
+    *pidp = reply;
+    return 0;
+}
+#else
+static void zygote_start(void) {
+    fprintf(stderr, "mtsh: --zygote: not supported on this system\n");
+}
+
+static int zygote_spawn(pid_t *pidp, const char *path, const struct stage *st,
+                        int in_fd, int out_fd) {
+    (void)pidp; (void)path; (void)st; (void)in_fd; (void)out_fd;
+    return -1;
+}
+#endif
+
+// spawn_path(), through the zygote when there is one.
+static int start_path(pid_t *pidp, const char *path, const struct stage *st,
+                      int in_fd, int out_fd) {
+    if (zygote_fd >= 0 && !spawn_pgroup && !spawn_place.set) { // The helper does not do those
+        int err = zygote_spawn(pidp, path, st, in_fd, out_fd);
+        n_zygote += err == 0;
+        if (err >= 0) return err;
+    }
+    return spawn_path(pidp, path, st, in_fd, out_fd);
+}
+
+// Resolve the stage's argv[0] through the PATH cache and start it.
+// Returns the child's PID, or -1 after printing an error.
+static pid_t spawn_command(const struct stage *st, int in_fd, int out_fd) {
+    uint64_t t0 = now_ns();
+    env_sync(); // Only does work if an exported variable changed
+    const char *name = st->argv[0];
+    const char *path = path_lookup(name);
+    pid_t pid = -1;
+    int err = path ? start_path(&pid, path, st, in_fd, out_fd) : 0;
+    if (err == ENOENT && path != name && access(path, X_OK) != 0) {
+        // The cached binary is gone: forget it and search $PATH once more.
+        path_cache_forget(name);
+        path = path_lookup(name);
+        err = path ? start_path(&pid, path, st, in_fd, out_fd) : 0;
+    }
+    lat_add(&phases[PH_SPAWN], now_ns() - t0);
+    if (!path) { fprintf(stderr, "mtsh: %s: command not found\n", name); return -1; }
+    if (err != 0) {
+        const char *file = redir_blame(st, err);
+        if (file) fprintf(stderr, "mtsh: cannot open %s: %s\n", file, strerror(err));
+        else fprintf(stderr, "mtsh: %s: %s\n", name, strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+// ------------------ Pipelines: a | b | c ------------------
+// A line is split at each "|" into stages. All stages are started before we
+// wait for any of them, so they run concurrently and the kernel moves the data
+// between them: stage i writes straight into the pipe that stage i+1 reads, the
+// shell itself never copies a byte.
+
+// NAME=value, with the name and the '=' unquoted: "FOO"=bar and FOO\=bar
+// are commands, FOO="a b" is an assignment.
+static int is_assignment(const struct token *t) {
+    size_t n = name_len(t->text);
+    return n > 0 && t->text[n] == '=' && n < t->plain;
+}
+
+// Group the line's tokens into stages: words become each stage's argv[],
+// redirection tokens plus the word after them become its redirs[].
+// `stages` needs room for one stage per token.
+// Returns the number of stages, or -1 (after printing why) on a syntax error.
+static int parse_pipeline(struct token *tk, int ntok, struct stage stages[]) {
+    // Every token yields at most one argv slot or one redirection; each "|"
+    // turns into the NULL ending a stage's argv, plus one NULL for the last.
+    char **argv = arena_alloc(&arena, ((size_t)ntok + 1) * sizeof *argv);
+    struct redir *rd = arena_alloc(&arena, (size_t)ntok * sizeof *rd);
+    if (!argv || !rd) { perror("mtsh"); return -1; }
+
+    int n = 0;
+    stages[0] = (struct stage){ argv, rd, 0, argv, 0 };
+    for (int i = 0; ; i++) {
+        if (i == ntok || tk[i].kind == TK_PIPE) {
+            if (stages[n].argv == argv && stages[n].nassigns == 0) { // No word at all in this stage
+                fprintf(stderr, "mtsh: syntax error near '%s'\n", i == ntok ? "newline" : "|");
+                return -1;
+            }
+            *argv++ = NULL; // Terminate this stage's argv
+            n++;
+            if (i == ntok) return n;
+            stages[n] = (struct stage){ argv, rd, 0, argv, 0 };
+        } else if (tk[i].kind == TK_REDIR) {
+            if (i + 1 == ntok || tk[i+1].kind != TK_WORD) {
+                fprintf(stderr, "mtsh: syntax error near '%s'\n", redir_names[tk[i].op]);
+                return -1;
+            }
+            rd->fd = tk[i].fd;
+            rd->op = tk[i].op;
+            rd->target = tk[++i].text; // The word after the operator
+            rd->dupfd = -1;
+            if (rd->op == R_DUP && strcmp(rd->target, "-") != 0) {
+                char *end;
+                long fd = strtol(rd->target, &end, 10);
+                if (end == rd->target || *end || fd < 0 || fd > 1023) {
+                    fprintf(stderr, "mtsh: %s: bad file descriptor\n", rd->target);
+                    return -1;
+                }
+                rd->dupfd = (int)fd;
+            }
+            rd++;
+            stages[n].nredirs++;
+        } else if (stages[n].argv == argv && is_assignment(&tk[i])) {
+            *argv++ = tk[i].text; // Still in front of the command: part of assigns[]
+            stages[n].argv = argv;
+            stages[n].nassigns++;
+        } else {
+            *argv++ = tk[i].text;
+        }
+    }
+}
+
+// Create a pipe whose two ends are close-on-exec, so no child inherits
+// pipe ends other than the ones dup2()ed onto its stdin/stdout.
+static int make_pipe(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) < 0) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+// ------------------ Builtin stages on threads ------------------
+// `printf ... | cmd` would cost two processes: a subshell forked for the
+// builtin (see spawn_builtin() below), and cmd. Builtins that touch nothing
+// but their argv and BI_OUT (BI_THREADED: echo, printf, test, ...) run on a
+// thread of the shell instead, one of BI_WORKERS started on first use and
+// kept, so such a pipeline costs one process. A worker has a small fd table
+// of its own, the stage's stdin and stdout (stderr is the shell's), and a
+// stdio stream of its own on that stdout. Those fds are the worker's to
+// close, which is what ends the next stage's input.
+// Stages with redirections or NAME=value of their own, `timeout` and `pin`
+// prefixes, timed and background pipelines, and stages that find no idle
+// worker fork as before. Workers are set going only after every process of
+// the pipeline has been started, and the shell waits for them before it
+// returns, so the shell never forks while one of them is running; a forked
+// subshell closes the fds reserved for workers and starts its own pool.
+// Workers block all signals: SIGPIPE from a reader that went away is taken
+// back with sigwait() and reported as it would be for a process.
+#define BI_WORKERS 4
+
+enum { W_IDLE, W_RUN, W_DONE };
+
+struct bi_worker {
+    pthread_t tid;
+    pthread_cond_t wake;  // state went to W_RUN
+    int started;          // The thread exists
+    int claimed;          // Reserved for a stage of the running pipeline
+    int state;            // W_*, under bi_lock
+    const struct builtin *b;
+    char **argv;
+    int fds[3];           // The stage's stdin, stdout, stderr; the worker closes 0 and 1
+    int status;           // Raw wait status, once W_DONE
+    uint64_t ns;          // How long the builtin ran
+};
+
+static pthread_mutex_t bi_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bi_done = PTHREAD_COND_INITIALIZER; // A worker went to W_DONE
+static struct bi_worker bi_workers[BI_WORKERS];
+
+// Run a worker's stage. Returns the wait status a process would have had.
+static int bi_run(struct bi_worker *w) {
+    uint64_t t0 = now_ns();
+    int code = 1;
+    bi_fds = w->fds;
+    bi_out = fdopen(w->fds[1], "w");
+    if (bi_out) {
+        code = w->b->fn(w->argv);
+        fclose(bi_out); // Flushes, and closes the pipe: the reader sees EOF
+    } else {
+        perror("mtsh: fdopen");
+        close(w->fds[1]);
+    }
+    bi_out = NULL;
+    if (w->fds[0] != STDIN_FILENO) close(w->fds[0]);
+    w->ns = now_ns() - t0;
+
+    sigset_t pending, pipe_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    int sig;
+    if (sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE) && sigwait(&pipe_set, &sig) == 0)
+        return SIGPIPE;     // "Killed by SIGPIPE", in the encoding every wait() uses
+    return (code & 0xff) << 8; // "Exited with code"
+}
+
+static void *bi_worker_main(void *arg) {
+    struct bi_worker *w = arg;
+    pthread_mutex_lock(&bi_lock);
+    for (;;) {
+        while (w->state != W_RUN) pthread_cond_wait(&w->wake, &bi_lock);
+        pthread_mutex_unlock(&bi_lock);
+        int status = bi_run(w);
+        pthread_mutex_lock(&bi_lock);
+        w->status = status;
+        w->state = W_DONE;
+        pthread_cond_signal(&bi_done); // Only the shell's thread waits on it
+    }
+    return NULL;
+}
+
+// Reserve an idle worker for stage st, which reads in_fd and writes out_fd
+// (both handed over: the worker closes them, but not our own stdin). Returns
+// NULL if the stage has to fork: it is not for a thread, or no worker is free.
+static struct bi_worker *bi_claim(const struct stage *st, int in_fd, int out_fd) {
+    const struct builtin *b = st->argv[0] ? find_builtin(st->argv[0]) : NULL;
+    if (!b || !(b->flags & BI_THREADED) || st->nredirs || st->nassigns) return NULL;
+    struct bi_worker *w = bi_workers;
+    while (w < bi_workers + BI_WORKERS && w->claimed) w++;
+    if (w == bi_workers + BI_WORKERS) return NULL;
+    if (!w->started) {
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old); // The thread starts with this mask
+        pthread_cond_init(&w->wake, NULL);
+        int err = pthread_create(&w->tid, NULL, bi_worker_main, w);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (err) return NULL;
+        pthread_detach(w->tid);
+        w->started = 1;
+    }
+    // The last stage writes to our stdout, through a copy the worker can close.
+    int out = out_fd != STDOUT_FILENO ? out_fd : fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    if (out < 0) return NULL;
+    w->claimed = 1;
+    w->b = b;
+    w->argv = st->argv;
+    w->fds[0] = in_fd;
+    w->fds[1] = out;
+    w->fds[2] = STDERR_FILENO;
+    return w;
+}
+
+// Set a claimed worker going.
+static void bi_start(struct bi_worker *w) {
+    n_threaded++; // For `stats`
+    pthread_mutex_lock(&bi_lock);
+    w->state = W_RUN;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&bi_lock);
+}
+
+// Wait for a started worker's stage to finish and free the worker. Returns
+// the stage's wait status; *ns is how long it ran.
+static int bi_join(struct bi_worker *w, uint64_t *ns) {
+    pthread_mutex_lock(&bi_lock);
+    while (w->state != W_DONE) pthread_cond_wait(&bi_done, &bi_lock);
+    w->state = W_IDLE;
+    pthread_mutex_unlock(&bi_lock);
+    w->claimed = 0;
+    *ns = w->ns;
+    return w->status;
+}
+
+// A forked subshell has none of our threads, only copies of the fds they
+// were given. It starts a pool of its own if it needs one.
+static void threads_forked(void) {
+    for (int i = 0; i < BI_WORKERS; i++) {
+        struct bi_worker *w = &bi_workers[i];
+        if (!w->claimed) continue;
+        if (w->fds[0] != STDIN_FILENO) close(w->fds[0]);
+        close(w->fds[1]);
+    }
+    memset(bi_workers, 0, sizeof bi_workers);
+    pthread_mutex_init(&bi_lock, NULL); // No other thread can hold it any more
+    pthread_cond_init(&bi_done, NULL);
+}
+
+static void timeouts_forked(void); // See "Jobs"
+
+// A builtin inside a pipeline gets its own process (a subshell), like in other
+// shells: it must run concurrently with the other stages, and `cd` or `exit`
+// there must not change the shell itself. `next_fd` is the read end of the
+// pipe out_fd writes to (or -1): the child must not keep it open, else it
+// would never see EPIPE once the reader is gone.
+static pid_t spawn_builtin(const struct stage *st, int in_fd, int out_fd, int next_fd) {
+    fflush(stdout); // Do not let the child inherit (and print again) our buffered output
+    pid_t pid = fork();
+    n_forked += pid > 0; // For `stats`
+    if (pid < 0) { perror("fork"); return -1; }
+    if (pid == 0) {
+        if (spawn_pgroup) setpgid(0, 0); // As in fork_path()
+        place_apply(&spawn_place);
+        zygote_detach();
+        exec_log_forked();
+        timeouts_forked();
+        threads_forked();
+        if (in_fd != STDIN_FILENO && dup2(in_fd, STDIN_FILENO) < 0) { perror("mtsh: dup2 stdin"); _exit(1); }
+        if (out_fd != STDOUT_FILENO && dup2(out_fd, STDOUT_FILENO) < 0) { perror("mtsh: dup2 stdout"); _exit(1); }
+        if (next_fd >= 0) close(next_fd);
+        if (apply_redirs(st->redirs, st->nredirs, NULL, NULL) < 0) _exit(1);
+        if (assign_vars(st->assigns, st->nassigns, NULL) < 0) _exit(1); // Our own copy of them
+        if (!st->argv[0]) _exit(0);
+        try_builtin(st->argv, NULL, 0);
+        fflush(stdout);
+        exec_log_flush(); // `parallel` and friends start processes of their own
+        _exit(last_status);
+    }
+    if (spawn_pgroup) setpgid(pid, pid);
+    return pid;
+}
+
+// Turn a wait status into a shell exit code (128 + signal number for killed commands).
+static int status_code(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status); // WEXITSTATUS(status) extracts the exit code
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
+
+// Print how a command ended, if it did not end well.
+// SIGPIPE is expected for early stages (think `yes | head`), so it stays quiet there.
+static void report_status(const char *name, int status, int quiet_sigpipe) {
+    // Check if the child exited normally or was killed by a signal
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        // Child exited with a non-zero exit code
+        // Print the exit code
+        fprintf(stderr, "%s: exit code: %d\n", name, WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        // Child was killed by a signal
+        // Print the signal number that killed the child
+        // Note: WTERMSIG(status) extracts the signal number from the status
+        // This is useful for debugging or understanding why a command failed
+        // e.g., if the command was killed by SIGKILL or SIGSEGV
+        if (!(quiet_sigpipe && WTERMSIG(status) == SIGPIPE))
+            fprintf(stderr, "%s: killed by signal %d (%s)\n", name, WTERMSIG(status),
+                    strsignal(WTERMSIG(status)));
+    }
+    // Child exited normally with exit code 0: no output needed
+}
+
+// ------------------ Resource accounting: `time` and `set -o timing` ------------------
+// Wall time comes from CLOCK_MONOTONIC read right before the first stage is
+// started and right after the last one is reaped. CPU time, memory and so on
+// come from the rusage the kernel hands back with each child through wait4(),
+// so measuring costs no extra process. A builtin run inside the shell is
+// measured with getrusage(RUSAGE_SELF) before and after instead, plus
+// RUSAGE_CHILDREN for the processes it ran (`time parallel ...`).
+// The report is one key=value line on stderr, easy to grep and to parse.
+
+static double ts_seconds(const struct timespec *a, const struct timespec *b) {
+    return (double)(b->tv_sec - a->tv_sec) + (double)(b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static double tv_seconds(const struct timeval *tv) {
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+// Add a child's usage to a running total. maxrss is a peak, so it is the max.
+static void rusage_add(struct rusage *sum, const struct rusage *ru) {
+    sum->ru_utime.tv_sec += ru->ru_utime.tv_sec;
+    sum->ru_utime.tv_usec += ru->ru_utime.tv_usec;
+    sum->ru_stime.tv_sec += ru->ru_stime.tv_sec;
+    sum->ru_stime.tv_usec += ru->ru_stime.tv_usec;
+    if (ru->ru_maxrss > sum->ru_maxrss) sum->ru_maxrss = ru->ru_maxrss;
+    sum->ru_minflt += ru->ru_minflt;
+    sum->ru_majflt += ru->ru_majflt;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+// Usage of the shell itself between two getrusage(RUSAGE_SELF) snapshots.
+static void rusage_delta(struct rusage *d, const struct rusage *before, const struct rusage *after) {
+    *d = *after;
+    d->ru_utime.tv_sec -= before->ru_utime.tv_sec;
+    d->ru_utime.tv_usec -= before->ru_utime.tv_usec;
+    d->ru_stime.tv_sec -= before->ru_stime.tv_sec;
+    d->ru_stime.tv_usec -= before->ru_stime.tv_usec;
+    d->ru_minflt -= before->ru_minflt;
+    d->ru_majflt -= before->ru_majflt;
+    d->ru_nvcsw -= before->ru_nvcsw;
+    d->ru_nivcsw -= before->ru_nivcsw;
+}
+
+// Print "time: CMD: real=... user=... ..." for a finished command.
+static void report_timing(const char *label, const struct timespec *t0,
+                          const struct timespec *t1, const struct rusage *ru) {
+    fprintf(stderr, "time: %s: real=%.6f user=%.6f sys=%.6f maxrss_kb=%ld nvcsw=%ld nivcsw=%ld minflt=%ld majflt=%ld\n",
+            label, ts_seconds(t0, t1), tv_seconds(&ru->ru_utime), tv_seconds(&ru->ru_stime),
+            ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt);
+}
+
+// The words of a pipeline as one string ("ls -l | wc"), in the arena.
+static char *pipeline_text(const struct stage stages[], int n) {
+    size_t len = 1;
+    for (int i = 0; i < n; i++)
+        for (char **w = stages[i].argv; *w; w++) len += strlen(*w) + 3;
+    char *text = arena_alloc(&arena, len), *p = text;
+    if (!text) return "?";
+    for (int i = 0; i < n; i++) {
+        if (i) { memcpy(p, " | ", 3); p += 3; }
+        for (char **w = stages[i].argv; *w; w++) {
+            if (w != stages[i].argv) *p++ = ' ';
+            size_t wl = strlen(*w);
+            memcpy(p, *w, wl);
+            p += wl;
+        }
+    }
+    *p = '\0';
+    return text;
+}
+
+// ------------------ Jobs: background commands and the SIGCHLD reaper ------------------
+// Every pipeline we start becomes a job with one struct proc per stage. The
+// foreground job lives in the arena and is waited for right away; a job
+// started with & is copied to the heap and kept in jobs[] until it is reported.
+// All children are reaped in one place, proc_exited(): the SIGCHLD handler
+// only sets a flag and writes a byte to a self-pipe (which a poll() can wait
+// on), and the shell collects exit statuses with wait4() when it gets to it:
+// before reading the next line, or while it waits for a job.
+#define JOBS_KEEP_DONE 1024 // Finished, never-waited-for jobs kept for `wait` in scripts
+
+struct proc {
+    pid_t pid;        // -1 if the stage could not be started, 0 if it ran on a worker thread
+                      // or a prefix (timeout, pin ...) rejected its arguments
+    int done;
+    int status;       // Raw wait status, once done
+    const char *name; // argv[0], for messages
+    uint64_t start;   // now_ns() when it was started, 0 if not timed
+    char *log;        // Its --exec-log record so far, or NULL
+    uint64_t deadline;   // now_ns() when `timeout` signals it next, 0 = never
+    uint64_t kill_after; // timeout -k: SIGKILL this long after `sig`, 0 = never
+    int sig;             // What `timeout` sends first
+    int group;           // It leads a process group of its own: signal the group
+    int timed_out;       // 1 once `sig` was sent, 2 once SIGKILL was
+};
+
+struct job {
+    int id;             // %1, %2 ... for background jobs, 0 for the foreground job
+    int nprocs, nleft;  // Stages, and how many of them are still running
+    struct proc *procs;
+    const char *cmd;    // Command text, for `jobs` and reports
+    int pipefail;       // `set -o pipefail` as it was when the job started
+    int timed;          // Report resource usage when it finishes
+    struct timespec t0; // CLOCK_MONOTONIC at start
+    struct rusage ru;   // Summed over all stages
+};
+
+static struct job *fg_job;  // The job the shell is waiting for, if any
+static struct job **jobs;   // Background jobs, oldest first
+static size_t njobs, jobs_cap;
+static size_t n_deadlines;  // Processes with a deadline, see timeouts_fire()
+
+static volatile sig_atomic_t sigchld_pending; // Set by the handler, cleared by reap_children()
+static int sigchld_pipe[2] = { -1, -1 };      // Self-pipe: one byte per SIGCHLD
+
+static void on_sigchld(int sig) {
+    (void)sig;
+    int saved = errno; // Do not disturb whatever the interrupted code was doing
+    sigchld_pending = 1;
+    if (sigchld_pipe[1] >= 0) { ssize_t r = write(sigchld_pipe[1], "", 1); (void)r; }
+    errno = saved;
+}
+
+static void jobs_init(void) {
+    if (make_pipe(sigchld_pipe) == 0) {
+        fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK); // A full pipe must never block the handler
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = on_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP; // Restart read()/wait4(); ignore stopped children
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+// A job's exit status: its last stage's, or with pipefail the last failing one.
+static int job_status(const struct job *j) {
+    int last = 0, failed = 0;
+    for (int i = 0; i < j->nprocs; i++) {
+        const struct proc *p = &j->procs[i];
+        last = p->pid < 0 ? 127 : status_code(p->status); // Not started: "command not found"
+        if (p->timed_out == 1) last = 124; // As timeout(1) says it; 137 if SIGKILL was needed
+        if (last != 0) failed = last;
+    }
+    return j->pipefail && failed ? failed : last;
+}
+
+// A child is gone: file its status under its job. This is the one place where
+// exit statuses are looked at, for foreground and background jobs alike.
+static void proc_exited(pid_t pid, int status, const struct rusage *ru) {
+    struct job *j = NULL;
+    struct proc *p = NULL;
+    for (size_t k = 0; !p && k <= njobs; k++) {
+        struct job *c = k < njobs ? jobs[k] : fg_job;
+        for (int i = 0; c && i < c->nprocs; i++)
+            if (c->procs[i].pid == pid && !c->procs[i].done) { j = c; p = &c->procs[i]; break; }
+    }
+    if (!p) return; // Not one of ours
+
+    p->done = 1;
+    p->status = status;
+    if (p->deadline) { p->deadline = 0; n_deadlines--; }
+    if (p->start) cmd_stat_add(p->name, now_ns() - p->start);
+    if (p->log) { exec_log_end(p->log, status, ru); p->log = NULL; }
+    j->nleft--;
+    rusage_add(&j->ru, ru);
+    // 127 means "could not exec": do not trust a cached path for it any more
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) path_cache_forget(p->name);
+    if (j == fg_job && p->timed_out) fprintf(stderr, "%s: timed out\n", p->name);
+    else if (j == fg_job) report_status(p->name, status, p != &j->procs[j->nprocs - 1]);
+    if (j->nleft == 0 && j->timed) {
+        struct timespec t1;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        report_timing(j->cmd, &j->t0, &t1, &j->ru);
+    }
+}
+
+// Signal every process whose `timeout` is up, in all jobs. Returns the next
+// deadline still ahead (in now_ns() time), or 0 if there is none.
+static uint64_t timeouts_fire(void) {
+    if (!n_deadlines) return 0;
+    uint64_t now = now_ns(), next = 0;
+    for (size_t k = 0; k <= njobs; k++) {
+        struct job *j = k < njobs ? jobs[k] : fg_job;
+        for (int i = 0; j && i < j->nprocs; i++) {
+            struct proc *p = &j->procs[i];
+            if (p->done || !p->deadline) continue;
+            if (p->deadline > now) {
+                if (!next || p->deadline < next) next = p->deadline;
+                continue;
+            }
+            // It has not been reaped, so neither its PID nor its process
+            // group ID can have been reused: no race with a new process.
+            int sig = p->timed_out ? SIGKILL : p->sig;
+            kill(p->group ? -p->pid : p->pid, sig);
+            if (sig != SIGKILL) kill(p->group ? -p->pid : p->pid, SIGCONT); // A stopped one must see it
+            p->timed_out++;
+            p->deadline = sig != SIGKILL && p->kill_after ? now + p->kill_after : 0;
+            if (p->deadline && (!next || p->deadline < next)) next = p->deadline;
+            if (!p->deadline) n_deadlines--;
+        }
+    }
+    return next;
+}
+
+// A forked subshell gets a copy of our jobs: their deadlines are still ours to keep.
+static void timeouts_forked(void) {
+    for (size_t k = 0; k <= njobs; k++) {
+        struct job *j = k < njobs ? jobs[k] : fg_job;
+        for (int i = 0; j && i < j->nprocs; i++) j->procs[i].deadline = 0;
+    }
+    n_deadlines = 0;
+}
+
+// Sleep until a SIGCHLD arrives, `fd` (if not -1) is readable, or the time
+// is `until`, whichever comes first. Returns 1 if fd is readable.
+static int wait_event(int fd, uint64_t until) {
+    struct pollfd pfd[2] = { { sigchld_pipe[0], POLLIN, 0 }, { fd, POLLIN, 0 } };
+    uint64_t now = now_ns(), left = until > now ? until - now : 0;
+#ifdef __linux__
+    struct timespec ts = { (time_t)(left / 1000000000), (long)(left % 1000000000) };
+    int r = ppoll(pfd, fd < 0 ? 1 : 2, &ts, NULL); // Nanoseconds, where poll() has milliseconds
+#else
+    int r = poll(pfd, fd < 0 ? 1 : 2, (int)((left + 999999) / 1000000));
+#endif
+    return r > 0 && fd >= 0 && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+// Collect every child that has finished, without blocking. Costs nothing
+// (not even a syscall) when no SIGCHLD arrived since the last call.
+static void reap_children(void) {
+    timeouts_fire(); // Nothing to do without a `timeout` running
+    if (!sigchld_pending) return;
+    sigchld_pending = 0; // Clear first: a child exiting from now on sets it again
+    char buf[64];
+    while (read(sigchld_pipe[0], buf, sizeof buf) > 0) {}
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) proc_exited(pid, status, &ru);
+}
+
+// Block until some child exits, and file it. Returns -1 if there is none left.
+// While a `timeout` runs, the wait is a poll() on the SIGCHLD self-pipe that
+// ends at the next deadline, so one loop serves any number of them.
+static int wait_one(void) {
+    for (;;) {
+        int status;
+        struct rusage ru;
+        uint64_t next = timeouts_fire();
+        if (next && sigchld_pipe[0] >= 0) {
+            char buf[64];
+            while (read(sigchld_pipe[0], buf, sizeof buf) > 0) {} // Drain first, then look:
+            pid_t pid = wait4(-1, &status, WNOHANG, &ru);        // an exit after this wakes the poll
+            if (pid > 0) { proc_exited(pid, status, &ru); return 0; }
+            if (pid < 0 && errno != EINTR) return -1;
+            wait_event(-1, next);
+            continue;
+        }
+        // wait4() waits for any child process to change state, like waitpid(),
+        // and also fills in the resources it used.
+        pid_t pid = wait4(-1, &status, 0, &ru);
+        if (pid > 0) { proc_exited(pid, status, &ru); return 0; }
+        if (errno != EINTR) return -1;
+    }
+}
+
+// Give up on the stages of j we can no longer wait for.
+static void job_abandon(struct job *j) {
+    perror("wait4");
+    for (int i = 0; i < j->nprocs; i++) {
+        struct proc *p = &j->procs[i];
+        if (p->done) continue;
+        if (p->deadline) { p->deadline = 0; n_deadlines--; }
+        p->done = 1;
+        p->pid = -1;
+    }
+    j->nleft = 0;
+}
+
+// Block until every stage of job j has finished. Other children that happen
+// to exit meanwhile are filed under their own jobs.
+static void wait_job(struct job *j) {
+    while (j->nleft > 0)
+        if (wait_one() < 0) job_abandon(j);
+}
+
+static int grow_jobs(void) {
+    if (njobs < jobs_cap) return 0;
+    size_t cap = jobs_cap ? jobs_cap * 2 : 16;
+    struct job **p = realloc(jobs, cap * sizeof *p);
+    if (!p) return -1;
+    jobs = p;
+    jobs_cap = cap;
+    return 0;
+}
+
+static void job_free(struct job *j) {
+    for (size_t k = 0; k < njobs; k++) {
+        if (jobs[k] != j) continue;
+        memmove(&jobs[k], &jobs[k+1], (njobs - k - 1) * sizeof *jobs);
+        njobs--;
+        break;
+    }
+    free(j);
+}
+
+// Move a just-started job from the arena to the heap and into jobs[].
+// Returns its new copy, or NULL (after printing why) if we are out of memory;
+// the processes keep running either way.
+static struct job *job_adopt(const struct job *j) {
+    // One allocation: the job, its procs, then the command text and stage names.
+    size_t size = sizeof *j + (size_t)j->nprocs * sizeof *j->procs + strlen(j->cmd) + 1;
+    for (int i = 0; i < j->nprocs; i++) size += strlen(j->procs[i].name) + 1;
+
+    // Scripts that never `wait` would pile up finished jobs forever: drop the oldest.
+    size_t ndone = 0;
+    for (size_t k = 0; k < njobs; k++) ndone += jobs[k]->nleft == 0;
+    for (size_t k = 0; ndone >= JOBS_KEEP_DONE && k < njobs; ) {
+        if (jobs[k]->nleft == 0) { job_free(jobs[k]); ndone--; } else k++;
+    }
+
+    struct job *c = malloc(size);
+    if (!c || grow_jobs() < 0) { free(c); perror("mtsh: jobs"); return NULL; }
+    *c = *j;
+    c->procs = (struct proc *)(c + 1);
+    char *text = (char *)(c->procs + j->nprocs);
+    for (int i = 0; i < j->nprocs; i++) {
+        c->procs[i] = j->procs[i];
+        c->procs[i].name = strcpy(text, j->procs[i].name);
+        text += strlen(text) + 1;
+    }
+    c->cmd = strcpy(text, j->cmd);
+    c->id = njobs ? jobs[njobs - 1]->id + 1 : 1;
+    jobs[njobs++] = c;
+    return c;
+}
+
+// "Running", "Done", "Exit 3" or "Killed (SIGTERM)"-style state of a job.
+static const char *job_state(const struct job *j, char *buf, size_t size) {
+    if (j->nleft > 0) return "Running";
+    int code = job_status(j);
+    const struct proc *last = &j->procs[j->nprocs - 1];
+    if (code == 0) return "Done";
+    if (last->timed_out) return "Timed out";
+    if (last->pid > 0 && WIFSIGNALED(last->status))
+        snprintf(buf, size, "Killed (%s)", strsignal(WTERMSIG(last->status)));
+    else
+        snprintf(buf, size, "Exit %d", code);
+    return buf;
+}
+
+static void print_job(const struct job *j, int with_pids) {
+    char buf[64];
+    printf("[%d]%c  %-16s %s", j->id, j == jobs[njobs - 1] ? '+' : ' ', job_state(j, buf, sizeof buf), j->cmd);
+    if (with_pids)
+        for (int i = 0; i < j->nprocs; i++) printf(" %ld", (long)j->procs[i].pid);
+    putchar('\n');
+}
+
+// Interactive shells announce finished background jobs ("[1]+  Done  cmd")
+// before the next prompt and then forget them. Scripts stay quiet and keep
+// them so that a later `wait` can still collect their status.
+static void notify_jobs(int interactive) {
+    if (!interactive) return;
+    for (size_t k = 0; k < njobs; ) {
+        if (jobs[k]->nleft > 0) { k++; continue; }
+        print_job(jobs[k], 0);
+        job_free(jobs[k]);
+    }
+    fflush(stdout);
+}
+
+// Find a job from a `wait`/`fg` operand: %N, %% or %+ (the latest), or a PID.
+static struct job *find_job(const char *spec) {
+    if (njobs == 0) return NULL;
+    if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) return jobs[njobs - 1];
+    if (spec[0] == '%') {
+        int id = atoi(spec + 1);
+        for (size_t k = 0; k < njobs; k++) if (jobs[k]->id == id) return jobs[k];
+        return NULL;
+    }
+    pid_t pid = (pid_t)atol(spec);
+    for (size_t k = 0; k < njobs; k++)
+        for (int i = 0; i < jobs[k]->nprocs; i++)
+            if (jobs[k]->procs[i].pid == pid) return jobs[k];
+    return NULL;
+}
+
+// jobs [-l]: list background jobs; finished ones are forgotten once shown.
+static int builtin_jobs(char *argv[]) {
+    int with_pids = argv[1] && strcmp(argv[1], "-l") == 0;
+    reap_children();
+    for (size_t k = 0; k < njobs; ) {
+        print_job(jobs[k], with_pids);
+        if (jobs[k]->nleft == 0) job_free(jobs[k]); else k++;
+    }
+    return 0;
+}
+
+// wait [%N|PID ...]: wait for the given jobs (returning the last one's status),
+// or for all background jobs (returning 0).
+static int builtin_wait(char *argv[]) {
+    fflush(stdout); // What we printed so far comes before what the jobs print from now on
+    if (!argv[1]) {
+        while (njobs > 0) { wait_job(jobs[0]); job_free(jobs[0]); }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; argv[i]; i++) {
+        struct job *j = find_job(argv[i]);
+        if (!j) { fprintf(stderr, "wait: %s: no such job\n", argv[i]); status = 127; continue; }
+        wait_job(j);
+        status = job_status(j);
+        job_free(j);
+    }
+    return status;
+}
+
+// fg [%N]: there is no terminal job control, so this means: show the job's
+// command, wait for it like for a foreground command, and return its status.
+static int builtin_fg(char *argv[]) {
+    struct job *j = find_job(argv[1]);
+    if (!j) { fprintf(stderr, "fg: %s: no such job\n", argv[1] ? argv[1] : "current"); return 1; }
+    printf("%s\n", j->cmd);
+    fflush(stdout);
+    fg_job = j;
+    wait_job(j);
+    fg_job = NULL;
+    int status = job_status(j);
+    job_free(j);
+    return status;
+}
+
+// ------------------ parallel: bounded fan-out over a list of items ------------------
+// parallel [-j N] [-k] [--pin CPUS] CMD ARGS... [::: ITEM...]
+// Runs CMD once per item, with at most N (default: one per CPU) running at a
+// time, and starts the next one as soon as the reaper files one as finished.
+// With --pin the items go round-robin over the CPUs in the list (see `pin`),
+// each job pinned to one of them, and N defaults to how many there are.
+// `{}` in ARGS is replaced by the item; without any `{}` the item is appended.
+// Items come after `:::`, or else one per line from stdin. With -k each job's
+// stdout goes to an unlinked temporary file that is copied out in item order,
+// so the output reads as if the jobs had run one after another.
+// The whole batch is one job, one struct proc per item, so failures are
+// reported like those of pipeline stages. The status is the number of failed
+// items (at most 101, like GNU parallel), 0 when all succeeded.
+
+// Read all of fd 0 into the arena and cut it into lines. Reads the fd, not
+// stdin's FILE buffer, which may hold the rest of a script read from stdin.
+static char **read_items(size_t *nitems) {
+    char *buf = NULL;
+    size_t cap = 0, len = 0;
+    for (;;) {
+        if (arena_grow((void **)&buf, &cap, len + 4096, 1) < 0) { perror("parallel"); return NULL; }
+        ssize_t r = read(STDIN_FILENO, buf + len, cap - len - 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) { perror("parallel: stdin"); return NULL; }
+        if (r == 0) break;
+        len += (size_t)r;
+    }
+    buf[len] = '\0';
+
+    size_t n = 0;
+    for (char *p = buf; (p = memchr(p, '\n', (size_t)(buf + len - p))); p++) n++;
+    char **items = arena_alloc(&arena, (n + 2) * sizeof *items);
+    if (!items) { perror("parallel"); return NULL; }
+    n = 0;
+    for (char *p = buf, *nl; p < buf + len; p = nl + 1) {
+        nl = memchr(p, '\n', (size_t)(buf + len - p));
+        if (!nl) nl = buf + len;
+        *nl = '\0';
+        if (*p) items[n++] = p; // Skip empty lines
+    }
+    *nitems = n;
+    return items;
+}
+
+// Build one item's argv from the template: every `{}` becomes the item.
+static char **parallel_argv(char **tmpl, int ntmpl, const char *item) {
+    char **argv = arena_alloc(&arena, (size_t)(ntmpl + 2) * sizeof *argv);
+    if (!argv) return NULL;
+    int n = 0, used = 0;
+    size_t il = strlen(item);
+    for (int i = 0; i < ntmpl; i++) {
+        size_t count = 0;
+        for (const char *p = tmpl[i]; (p = strstr(p, "{}")); p += 2) count++;
+        if (!count) { argv[n++] = tmpl[i]; continue; }
+        used = 1;
+        char *w = arena_alloc(&arena, strlen(tmpl[i]) + count * il + 1), *o = w;
+        if (!w) return NULL;
+        for (const char *p = tmpl[i], *q; ; p = q + 2) {
+            q = strstr(p, "{}");
+            size_t l = q ? (size_t)(q - p) : strlen(p);
+            memcpy(o, p, l);
+            o += l;
+            if (!q) break;
+            memcpy(o, item, il);
+            o += il;
+        }
+        *o = '\0';
+        argv[n++] = w;
+    }
+    if (!used) argv[n++] = (char *)item;
+    argv[n] = NULL;
+    return argv;
+}
+
+// An anonymous file for one job's buffered output (-k).
+static int temp_fd(void) {
+    const char *dir = var_get("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+#ifdef O_TMPFILE
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600); // Never has a name at all
+    if (fd >= 0) return fd;
+#endif
+    char path[4096];
+    snprintf(path, sizeof path, "%s/mtsh-parallel-XXXXXX", dir);
+    int fd2 = mkstemp(path);
+    if (fd2 < 0) return -1;
+    unlink(path);
+    fcntl(fd2, F_SETFD, FD_CLOEXEC);
+    return fd2;
+}
+
+// Copy a finished job's buffered output to stdout and close it.
+static void flush_output(int fd) {
+    char buf[IO_BUFSIZE];
+    ssize_t r;
+    if (lseek(fd, 0, SEEK_SET) == 0) {
+        while ((r = read(fd, buf, sizeof buf)) > 0 || (r < 0 && errno == EINTR))
+            if (r > 0 && write_all(STDOUT_FILENO, buf, (size_t)r) < 0) break; // stdout is gone: stop reading too
+    }
+    close(fd);
+}
+
+static int builtin_parallel(char *argv[]) {
+    long njobs_max = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_order = 0, i = 1, njobs_given = 0;
+    int *pin = NULL, npin = 0; // --pin: the CPUs to go round
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--") == 0) { i++; break; }
+        if (strcmp(argv[i], "-k") == 0) { keep_order = 1; continue; }
+        if (strcmp(argv[i], "--pin") == 0) {
+#ifdef __linux__
+            cpu_set_t set;
+            if (!argv[i+1] || parse_cpus(argv[++i], &set) < 0) {
+                fprintf(stderr, "parallel: --pin: expected a CPU list like 0-3,8\n");
+                return 2;
+            }
+            if (usable_cpus("parallel", &set) < 0) return 1;
+            if (!(pin = arena_alloc(&arena, (size_t)CPU_COUNT(&set) * sizeof *pin))) { perror("parallel"); return 1; }
+            for (int c = 0; c < CPU_SETSIZE; c++) if (CPU_ISSET(c, &set)) pin[npin++] = c;
+            continue;
+#else
+            fprintf(stderr, "parallel: --pin: not supported on this system\n");
+            return 2;
+#endif
+        }
+        if (strncmp(argv[i], "-j", 2) == 0) {
+            const char *n = argv[i][2] ? argv[i] + 2 : argv[++i];
+            char *end;
+            njobs_max = n ? strtol(n, &end, 10) : 0;
+            if (!n || *end || njobs_max < 1) {
+                fprintf(stderr, "parallel: -j: expected a positive number\n");
+                return 2;
+            }
+            njobs_given = 1;
+            continue;
+        }
+        fprintf(stderr, "parallel: %s: unknown option\n", argv[i]);
+        return 2;
+    }
+    if (npin && !njobs_given) njobs_max = npin;
+    if (njobs_max < 1) njobs_max = 1;
+
+    char **tmpl = &argv[i];
+    int ntmpl = 0;
+    while (tmpl[ntmpl] && strcmp(tmpl[ntmpl], ":::") != 0) ntmpl++;
+    if (ntmpl == 0) {
+        fprintf(stderr, "usage: parallel [-j N] [-k] [--pin CPUS] cmd [args, {} = item] [::: item...]\n");
+        return 2;
+    }
+    char **items;
+    size_t nitems = 0;
+    int in_fd = STDIN_FILENO;
+    if (tmpl[ntmpl]) { // ::: item...
+        items = &tmpl[ntmpl + 1];
+        while (items[nitems]) nitems++;
+    } else {
+        if (!(items = read_items(&nitems))) return 1;
+        in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); // Our stdin is used up
+        if (in_fd < 0) in_fd = STDIN_FILENO;
+    }
+    if (nitems == 0) { if (in_fd != STDIN_FILENO) close(in_fd); return 0; }
+
+    fflush(stdout);
+    struct job job = { 0 };
+    job.procs = arena_alloc(&arena, nitems * sizeof *job.procs);
+    int *out = keep_order ? arena_alloc(&arena, nitems * sizeof *out) : NULL;
+    if (!job.procs || (keep_order && !out)) { perror("parallel"); return 1; }
+    job.cmd = tmpl[0];
+    struct job *outer = fg_job; // We may be running under `time` or inside `fg`
+    fg_job = &job;
+
+    size_t flushed = 0; // -k: items whose output has been copied out
+    while (flushed < nitems || job.nleft > 0) {
+        // Fill the free slots, then wait for one of them to come free.
+        while ((size_t)job.nprocs < nitems && job.nleft < njobs_max) {
+            struct proc *p = &job.procs[job.nprocs];
+            struct stage st = { parallel_argv(tmpl, ntmpl, items[job.nprocs]), NULL, 0, NULL, 0 };
+            int fd = keep_order ? temp_fd() : STDOUT_FILENO;
+            if (keep_order) out[job.nprocs] = fd;
+            *p = (struct proc){ 0 };
+            p->name = tmpl[0];
+            p->start = now_ns();
+#ifdef __linux__
+            if (npin) { // Round-robin, applied in the child like `pin`
+                spawn_place.set = spawn_place.has_cpus = 1;
+                CPU_ZERO(&spawn_place.cpus);
+                CPU_SET(pin[job.nprocs % npin], &spawn_place.cpus);
+            }
+#endif
+            p->pid = st.argv && fd >= 0 ? spawn_command(&st, in_fd, fd) : -1;
+            memset(&spawn_place, 0, sizeof spawn_place);
+            p->log = st.argv ? exec_log_start(st.argv, p->pid) : NULL;
+            if (fd < 0 || !st.argv) perror("parallel");
+            p->done = p->pid < 0;
+            job.nleft += !p->done;
+            job.nprocs++;
+        }
+        while (keep_order && flushed < (size_t)job.nprocs && job.procs[flushed].done) {
+            if (out[flushed] >= 0) flush_output(out[flushed]);
+            flushed++;
+        }
+        if (!keep_order) flushed = (size_t)job.nprocs;
+        if (job.nleft > 0 && wait_one() < 0) job_abandon(&job);
+    }
+    fg_job = outer;
+    if (in_fd != STDIN_FILENO) close(in_fd);
+
+    int failed = 0;
+    for (size_t k = 0; k < nitems; k++) {
+        const struct proc *p = &job.procs[k];
+        failed += p->pid < 0 || status_code(p->status) != 0;
+    }
+    return failed > 101 ? 101 : failed;
+}
+
+// ------------------ memo: remember a command's output ------------------
+// `memo git rev-parse HEAD` runs the command once and stores its stdout,
+// stderr and exit status under ~/.cache/mtsh/memo (or $XDG_CACHE_HOME). Later
+// runs with the same key replay the stored output instead of starting
+// anything. The key is argv, the current directory, the variables named
+// with -e and the size and mtime of the files named with -i; the entry file
+// is named after a 128-bit hash of it and also holds the key itself, so a
+// hash collision is a miss, not a wrong answer. Replaying copies file to
+// file (or to a pipe) inside the kernel with copy_file_range()/sendfile().
+// On a miss the output comes out when the command has finished, stdout
+// first, since it is collected in temporary files first.
+#define MEMO_MAGIC "MTSHMEM1"
+
+struct memo_header {      // Followed by key[keylen], stdout[outlen], stderr[errlen]
+    char magic[8];
+    uint32_t status;      // Exit code
+    uint32_t keylen;
+    uint64_t outlen, errlen;
+};
+
+static unsigned long memo_hits, memo_misses;
+
+// $XDG_CACHE_HOME/mtsh/<sub> (default ~/.cache/mtsh/<sub>), created if
+// needed. A malloc()ed path, or NULL.
+static char *cache_dir(const char *sub) {
+    const char *base = var_get("XDG_CACHE_HOME"), *home = var_get("HOME");
+    char path[4096];
+    int n;
+    if (base && *base) n = snprintf(path, sizeof path, "%s/mtsh/%s", base, sub);
+    else if (home) n = snprintf(path, sizeof path, "%s/.cache/mtsh/%s", home, sub);
+    else return NULL;
+    if (n < 0 || (size_t)n >= sizeof path) return NULL;
+    for (char *p = path + 1; ; p++) { // mkdir -p
+        if (*p != '/' && *p) continue;
+        char c = *p;
+        *p = '\0';
+        if (mkdir(path, 0700) < 0 && errno != EEXIST) return NULL;
+        *p = c;
+        if (!c) break;
+    }
+    return strdup(path);
+}
+
+// The file in `dir` for key[0..len): named after a 128-bit hash of the key,
+// from two FNV-1a variants.
+static void cache_entry(char *buf, size_t size, const char *dir, const char *key, size_t len) {
+    uint64_t h1 = 14695981039346656037ull, h2 = 0x9e3779b97f4a7c15ull;
+    for (size_t k = 0; k < len; k++) {
+        h1 = (h1 ^ (unsigned char)key[k]) * 1099511628211ull;
+        h2 = (h2 ^ (unsigned char)key[k]) * 0x100000001b3ull + (h2 >> 29);
+    }
+    snprintf(buf, size, "%s/%016llx%016llx", dir, (unsigned long long)h1, (unsigned long long)h2);
+}
+
+// Copy len bytes at offset off of file `in` to the current offset of `out`.
+static int copy_range(int in, off_t off, int out, uint64_t len) {
+#ifdef __linux__
+    // Within the kernel: file to file first, then file to anything.
+    while (len > 0) {
+        ssize_t r = copy_file_range(in, &off, out, NULL, len, 0);
+        if (r <= 0) break;
+        len -= (uint64_t)r;
+    }
+    while (len > 0) {
+        ssize_t r = sendfile(out, in, &off, len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        len -= (uint64_t)r;
+    }
+#endif
+    char buf[IO_BUFSIZE];
+    while (len > 0) {
+        ssize_t r = pread(in, buf, len < sizeof buf ? len : sizeof buf, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0 || write_all(out, buf, (size_t)r) < 0) return -1;
+        off += r;
+        len -= (uint64_t)r;
+    }
+    return 0;
+}
+
+// Append s (with its NUL) to the key being built in the arena.
+static int key_add(char **key, size_t *len, size_t *cap, const char *s) {
+    size_t n = strlen(s) + 1;
+    if (arena_grow((void **)key, cap, *len + n, 1) < 0) return -1;
+    memcpy(*key + *len, s, n);
+    *len += n;
+    return 0;
+}
+
+// Try to replay the entry at `path`. Returns the exit status, or -1 on a miss.
+static int memo_replay(const char *path, const char *key, size_t keylen) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct memo_header h;
+    struct stat st;
+    char *stored = NULL;
+    int status = -1;
+    if (read_all(fd, &h, sizeof h) == 0 && memcmp(h.magic, MEMO_MAGIC, 8) == 0 && h.keylen == keylen &&
+        fstat(fd, &st) == 0 && (uint64_t)st.st_size == sizeof h + keylen + h.outlen + h.errlen &&
+        (stored = arena_alloc(&arena, keylen)) && read_all(fd, stored, keylen) == 0 &&
+        memcmp(stored, key, keylen) == 0) {
+        off_t off = (off_t)(sizeof h + keylen);
+        copy_range(fd, off, STDOUT_FILENO, h.outlen);
+        copy_range(fd, off + (off_t)h.outlen, STDERR_FILENO, h.errlen);
+        status = (int)h.status;
+    }
+    close(fd);
+    return status;
+}
+
+// Store a finished command's output as the entry at `path`, written under a
+// temporary name and renamed into place, so readers never see half of one.
+static void memo_store(const char *path, const char *key, size_t keylen, int status, int out, int err) {
+    struct stat so, se;
+    if (fstat(out, &so) < 0 || fstat(err, &se) < 0) return;
+    struct memo_header h = { MEMO_MAGIC, (uint32_t)status, (uint32_t)keylen,
+                             (uint64_t)so.st_size, (uint64_t)se.st_size };
+    char tmp[4250];
+    snprintf(tmp, sizeof tmp, "%s.%ld", path, (long)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    int bad = write_all(fd, &h, sizeof h) < 0 || write_all(fd, key, keylen) < 0 ||
+              copy_range(out, 0, fd, h.outlen) < 0 || copy_range(err, 0, fd, h.errlen) < 0;
+    if (close(fd) < 0 || bad || rename(tmp, path) < 0) unlink(tmp);
+}
+
+// memo [-e VAR]... [-i FILE]... cmd [args...]
+// memo --stats
+static int builtin_memo(char *argv[]) {
+    if (argv[1] && strcmp(argv[1], "--stats") == 0) {
+        printf("memo: %lu hits, %lu misses\n", memo_hits, memo_misses);
+        return 0;
+    }
+    // The key: a version tag, the directory, argv, then the -e and -i parts.
+    char *key = NULL, cwd[4096], buf[4200];
+    size_t len = 0, cap = 0;
+    if (!getcwd(cwd, sizeof cwd)) cwd[0] = '\0';
+    int err = key_add(&key, &len, &cap, MEMO_MAGIC) < 0 || key_add(&key, &len, &cap, cwd) < 0;
+    int i = 1;
+    for (; argv[i] && argv[i][0] == '-' && !err; i++) {
+        if (strcmp(argv[i], "--") == 0) { i++; break; }
+        int env = strcmp(argv[i], "-e") == 0;
+        if ((!env && strcmp(argv[i], "-i") != 0) || !argv[i+1]) {
+            fprintf(stderr, "usage: memo [-e VAR]... [-i FILE]... cmd [args...]\n");
+            return 2;
+        }
+        const char *name = argv[++i];
+        struct stat st;
+        if (env) {
+            const char *v = var_get(name);
+            snprintf(buf, sizeof buf, "-e%s%s%s", name, v ? "=" : "", v ? v : "");
+        } else if (stat(name, &st) == 0) {
+            snprintf(buf, sizeof buf, "-i%s %lld.%09ld %lld", name, (long long)st.st_mtim.tv_sec,
+                     (long)st.st_mtim.tv_nsec, (long long)st.st_size);
+        } else {
+            snprintf(buf, sizeof buf, "-i%s missing", name);
+        }
+        err = key_add(&key, &len, &cap, buf) < 0;
+    }
+    if (!argv[i]) { fprintf(stderr, "usage: memo [-e VAR]... [-i FILE]... cmd [args...]\n"); return 2; }
+    for (int k = i; argv[k] && !err; k++) err = key_add(&key, &len, &cap, argv[k]) < 0;
+    char *dir = cache_dir("memo");
+    if (err || !dir) { free(dir); fprintf(stderr, "memo: no cache directory\n"); return 1; }
+
+    cache_entry(buf, sizeof buf, dir, key, len);
+    free(dir);
+
+    fflush(stdout);
+    int status = memo_replay(buf, key, len);
+    if (status >= 0) { memo_hits++; return status; }
+    memo_misses++;
+
+    // Miss: run it with stdout and stderr in temporary files, then keep and replay those.
+    int out = temp_fd(), errfd = temp_fd();
+    if (out < 0 || errfd < 0) {
+        perror("memo");
+        if (out >= 0) close(out);
+        if (errfd >= 0) close(errfd);
+        return 1;
+    }
+    struct redir to_err = { STDERR_FILENO, R_DUP, errfd, NULL };
+    struct stage st = { &argv[i], &to_err, 1, NULL, 0 };
+    struct job job = { 0 };
+    uint64_t t0 = now_ns();
+    struct proc p = { spawn_command(&st, STDIN_FILENO, out), 0, 0, argv[i], t0, NULL, 0, 0, 0, 0, 0 };
+    p.log = exec_log_start(&argv[i], p.pid);
+    job.procs = &p;
+    job.nprocs = 1;
+    job.nleft = p.pid > 0;
+    job.cmd = argv[i];
+    struct job *outer = fg_job; // As in parallel: we may be running under `time`
+    fg_job = &job;
+    wait_job(&job);
+    fg_job = outer;
+    status = p.pid > 0 ? status_code(p.status) : 127;
+    if (p.pid > 0 && WIFEXITED(p.status)) memo_store(buf, key, len, status, out, errfd);
+    copy_range(out, 0, STDOUT_FILENO, (uint64_t)lseek(out, 0, SEEK_END));
+    copy_range(errfd, 0, STDERR_FILENO, (uint64_t)lseek(errfd, 0, SEEK_END));
+    close(out);
+    close(errfd);
+    return status;
+}
+
+// ------------------ timeout: a deadline for a command ------------------
+// `timeout [-s SIG] [-k DURATION] [--foreground] DURATION cmd ...` runs cmd
+// and sends it SIG (default TERM) when DURATION is up, then SIGKILL another
+// -k DURATION later if it is still there. Durations are seconds, fractions
+// allowed, or with an s, m, h or d suffix; 0 means no deadline. The exit
+// status is 124 if it timed out, as with timeout(1), but there is no extra
+// timeout process and no SIGALRM: like `time`, it is a prefix run_pipeline()
+// handles itself, in any stage of a pipeline and in background jobs too.
+// The command leads a process group of its own, so whatever it starts is
+// signalled as well (with --foreground only the command is, and it stays in
+// the shell's group, where Ctrl-C from the terminal reaches it).
+//
+// The deadline is kept on the job's struct proc and enforced by the reaper,
+// see timeouts_fire(): wait_one() sleeps in poll() on the SIGCHLD self-pipe
+// until the nearest deadline, reap_children() checks them before every line,
+// and the line editor while it waits for keys. Any number of concurrent
+// timeouts costs one poll(), no thread or timer per job.
+static const struct { const char *name; int sig; } sig_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+};
+
+// A signal by number, or by name with or without "SIG". -1 if unknown.
+static int parse_signal(const char *s) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (end != s && !*end) return n > 0 && n < NSIG ? (int)n : -1;
+    if (strncmp(s, "SIG", 3) == 0) s += 3;
+    for (size_t i = 0; i < sizeof sig_names / sizeof sig_names[0]; i++)
+        if (strcmp(s, sig_names[i].name) == 0) return sig_names[i].sig;
+    return -1;
+}
+
+// "1.5", "90s", "2m", "1h", "1d" in nanoseconds. Returns 0, or -1 if it is none of those.
+static int parse_duration(const char *s, uint64_t *ns) {
+    char *end;
+    double v = strtod(s, &end), unit = 1;
+    if (end == s) return -1;
+    switch (*end) {
+    case 's': end++; break;
+    case 'm': unit = 60; end++; break;
+    case 'h': unit = 3600; end++; break;
+    case 'd': unit = 86400; end++; break;
+    }
+    if (*end || !(v >= 0 && v * unit < 1e9)) return -1; // Also NaN; 1e9 s is 31 years
+    *ns = (uint64_t)(v * unit * 1e9);
+    return 0;
+}
+
+// If *argvp starts with `timeout ...`, move it past the prefix and fill in
+// p's deadline (from now), first signal and so on. Returns 1 if it took a
+// prefix, 0 if there is none, or -1 after a usage message.
+static int timeout_prefix(char ***argvp, struct proc *p) {
+    char **argv = *argvp;
+    if (!argv[0] || strcmp(argv[0], "timeout") != 0) return 0;
+    p->sig = SIGTERM;
+    p->group = 1;
+    int i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--") == 0) { i++; break; }
+        if (strcmp(argv[i], "--foreground") == 0) { p->group = 0; continue; }
+        if (strcmp(argv[i], "-s") == 0 && argv[i+1] && (p->sig = parse_signal(argv[i+1])) > 0) { i++; continue; }
+        if (strcmp(argv[i], "-k") == 0 && argv[i+1] && parse_duration(argv[i+1], &p->kill_after) == 0) { i++; continue; }
+        goto usage;
+    }
+    if (!argv[i] || parse_duration(argv[i], &p->deadline) < 0 || !argv[i+1]) goto usage;
+    if (p->deadline) p->deadline += now_ns();
+    *argvp = &argv[i+1];
+    return 1;
+usage:
+    fprintf(stderr, "usage: timeout [-s SIG] [-k DURATION] [--foreground] DURATION cmd [args...]\n");
+    p->deadline = 0;
+    return -1;
+}
+
+// Start every stage, then (unless `background`) wait for all of them. The
+// pipeline's status is the last stage's, or with `set -o pipefail` the last
+// non-zero one. With `timed`, the resource usage of all stages is reported at the end.
+static int run_pipeline(struct stage stages[], int n, int timed, int background) {
+    fflush(stdout); // Output of earlier builtins must reach stdout before any child's output
+    struct job job = { 0 };
+    job.procs = arena_alloc(&arena, (size_t)n * sizeof *job.procs);
+    struct bi_worker **workers = arena_alloc(&arena, (size_t)n * sizeof *workers); // Stage i's, or NULL
+    if (!job.procs || !workers) { perror("mtsh"); return 1; }
+    job.cmd = pipeline_text(stages, n);
+    job.pipefail = opt_pipefail;
+    job.timed = timed;
+    if (timed) clock_gettime(CLOCK_MONOTONIC, &job.t0);
+
+    // Without job control, a background job must not compete with the shell
+    // for its stdin: it reads /dev/null unless it has its own redirection.
+    int in_fd = STDIN_FILENO; // Read end of the previous stage's pipe
+    if (background) {
+        in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0) in_fd = STDIN_FILENO;
+    }
+    for (; job.nprocs < n; job.nprocs++) {
+        struct stage one = stages[job.nprocs], *st = &one; // Its argv may lose a `timeout` prefix
+        int fds[2] = { -1, STDOUT_FILENO }; // The last stage writes to our stdout
+        if (job.nprocs < n - 1 && make_pipe(fds) < 0) { perror("mtsh: pipe"); break; }
+
+        // ------------------ exec external command ------------------
+        struct proc *p = &job.procs[job.nprocs];
+        *p = (struct proc){ 0 };
+        int r = 1; // Prefixes, in any order: see "timeout" and "Placement"
+        while (r > 0) {
+            r = timeout_prefix(&st->argv, p);
+            if (r == 0) r = place_prefix(&st->argv, &spawn_place);
+        }
+        int bad = r < 0;
+        p->name = st->argv[0] ? st->argv[0] : "mtsh";
+        p->start = now_ns();
+        spawn_pgroup = p->group;
+        workers[job.nprocs] = NULL;
+        if (bad) { // Nothing to start; timeout(1) and nice(1) exit 125 for their own errors
+            p->pid = 0;
+            p->status = 125 << 8;
+        } else if (!st->argv[0] || find_builtin(st->argv[0])) { // See "Builtin stages on threads"
+            int threads_ok = !background && !timed && !p->sig && !spawn_place.set;
+            if (!threads_ok || !(workers[job.nprocs] = bi_claim(st, in_fd, fds[1])))
+                p->pid = spawn_builtin(st, in_fd, fds[1], fds[0]);
+        } else { // NAME=value in front: in this command's environment only
+            struct saved_var *save = arena_alloc(&arena, ((size_t)st->nassigns + 1) * sizeof *save);
+            p->pid = -1;
+            if (save && assign_vars(st->assigns, st->nassigns, save) == 0)
+                p->pid = spawn_command(st, in_fd, fds[1]); // see spawn_command() above
+            if (save) restore_vars(save, st->nassigns);
+        }
+        spawn_pgroup = 0;
+        memset(&spawn_place, 0, sizeof spawn_place);
+        p->log = st->argv[0] && p->pid ? exec_log_start(st->argv, p->pid) : NULL;
+        p->done = p->pid <= 0; // A worker's stage is joined below, never reaped
+        job.nleft += !p->done;
+        if (p->done) p->deadline = 0;
+        n_deadlines += p->deadline != 0;
+
+        // The children have their copies now; closing ours lets readers see EOF.
+        // A worker's two fds are its own to close.
+        if (in_fd != STDIN_FILENO && !workers[job.nprocs]) close(in_fd);
+        if (fds[1] != STDOUT_FILENO && !workers[job.nprocs]) close(fds[1]);
+        in_fd = fds[0];
+    }
+    for (int i = 0; i < job.nprocs; i++) if (workers[i]) bi_start(workers[i]);
+    if (in_fd >= 0 && in_fd != STDIN_FILENO) close(in_fd);
+    int complete = job.nprocs == n; // Or we could not even set up the pipeline
+
+    if (background && job.nleft > 0) {
+        last_bg_pid = job.procs[job.nprocs - 1].pid; // $!
+        struct job *j = job_adopt(&job);
+        if (j && isatty(STDIN_FILENO)) fprintf(stderr, "[%d] %ld\n", j->id, (long)j->procs[j->nprocs - 1].pid);
+        return complete ? 0 : 1;
+    }
+
+    // ------------------ Wait for child processes ------------------
+    // The reaper prints their exit codes as they finish, see proc_exited().
+    fg_job = &job;
+    uint64_t t0 = now_ns();
+    wait_job(&job);
+    for (int i = 0; i < job.nprocs; i++) { // As proc_exited() does for processes
+        if (!workers[i]) continue;
+        struct proc *p = &job.procs[i];
+        uint64_t ns;
+        p->status = bi_join(workers[i], &ns);
+        cmd_stat_add(p->name, ns);
+        report_status(p->name, p->status, i != job.nprocs - 1);
+    }
+    lat_add(&phases[PH_WAIT], now_ns() - t0);
+    fg_job = NULL;
+    return complete ? job_status(&job) : 1;
+}
+
+// ------------------ Pathname expansion: *, ? and [...] ------------------
+// A word with an unquoted *, ? or [...] is replaced by the sorted names that
+// match it, or stays as it is when nothing does (as in sh). Each path
+// component is matched against a listing of its directory, and listings are
+// kept for the rest of the command, so `ls *.log *.gz` reads the directory
+// once. On Linux the listing comes straight from getdents64() in 64 KiB
+// batches, and the d_type it returns tells directories apart without a
+// stat() per entry; only symlinks and file systems that do not fill in
+// d_type need one, and only when the pattern goes on below them.
+#define GLOB_DIRBUF (64 * 1024) // Bytes per getdents64() call
+#define GLOB_PATH_MAX 4096      // Longest path we build
+
+struct dir_entry {
+    size_t off;         // Name at names + off
+    unsigned char type; // DT_* from the directory, DT_UNKNOWN if it did not say
+};
+
+struct dir_listing {
+    struct dir_listing *next;
+    char *path;              // "" for the current directory
+    char *names;             // All names, NUL-terminated, back to back
+    struct dir_entry *ents;
+    size_t n;
+};
+
+static struct dir_listing *dir_cache; // Listings read for the current command, in the arena
+
+#ifndef DT_UNKNOWN // Systems without d_type: every entry needs a stat() when it matters
+#define DT_UNKNOWN 0
+#define DT_DIR 4
+#define DT_LNK 10
+#endif
+
+static int match_bracket(const char **pp, const char *pend, unsigned char c);
+
+// Does [p, end) contain a * or ? that was not quoted, or a [...] that is
+// closed within its path component? A lone [ (as in `[ a = a ]`) is an
+// ordinary byte, and a word without any of these never lists a directory.
+static int glob_bytes(const char *p, const char *end) {
+    const char *open_until = p; // A [ before this found no ]: later ones will not either
+    for (; p < end; p++) {
+        if (*p == QUOTE_MARK) { if (++p == end) break; continue; }
+        if (*p == '*' || *p == '?') return 1;
+        if (*p != '[' || p < open_until) continue;
+        const char *q = p, *stop = p;
+        while (stop < end && *stop != '/') stop++;
+        if (match_bracket(&q, stop, 0) >= 0) return 1;
+        open_until = stop;
+    }
+    return 0;
+}
+
+// Does word w have anything for pathname expansion to do?
+static int has_glob(const char *w) { return glob_bytes(w, w + strlen(w)); }
+
+// The word without its QUOTE_MARKs (itself if it has none).
+static char *unquote(char *w) {
+    if (!strchr(w, QUOTE_MARK)) return w;
+    char *out = arena_alloc(&arena, strlen(w) + 1), *o = out;
+    if (!out) return w;
+    for (const char *p = w; *p; p++) {
+        if (*p == QUOTE_MARK && p[1]) p++;
+        *o++ = *p;
+    }
+    *o = '\0';
+    return out;
+}
+
+// Match byte c against the bracket expression at *pp ([abc], [a-z], [!x]),
+// moving *pp past it. Returns 1 or 0, or -1 if there is no closing ']'
+// (then the '[' is an ordinary byte).
+static int match_bracket(const char **pp, const char *pend, unsigned char c) {
+    const char *p = *pp + 1;
+    int negate = p < pend && (*p == '!' || *p == '^');
+    if (negate) p++;
+    int found = 0;
+    for (int first = 1; ; first = 0) {
+        if (p >= pend) return -1;
+        if (*p == ']' && !first) break;
+        unsigned char lo = (unsigned char)*p++;
+        if (lo == QUOTE_MARK && p < pend) lo = (unsigned char)*p++;
+        unsigned char hi = lo;
+        if (p + 1 < pend && *p == '-' && p[1] != ']') {
+            p++;
+            hi = (unsigned char)*p++;
+            if (hi == QUOTE_MARK && p < pend) hi = (unsigned char)*p++;
+        }
+        if (lo <= c && c <= hi) found = 1;
+    }
+    *pp = p + 1;
+    return found != negate;
+}
+
+// Does `name` match the pattern [pat, pend)? Iterative: on a mismatch only
+// the most recent * is retried, one byte further along the name. Matching
+// a*b*c one star at a time like this is enough (a later star can absorb
+// whatever an earlier one failed to), so it takes O(pattern * name) steps at
+// worst, where a backtracking matcher can take exponential time.
+static int glob_match(const char *pat, const char *pend, const char *name) {
+    const char *p = pat, *n = name;
+    const char *star_p = NULL, *star_n = NULL; // Where to resume after the last *
+    for (;;) {
+        if (p < pend) {
+            if (*p == '*') { star_p = ++p; star_n = n; continue; }
+            if (*n) {
+                const char *q = p;
+                int ok;
+                if (*p == '?') { ok = 1; q++; }
+                else if (*p == '[' && (ok = match_bracket(&q, pend, (unsigned char)*n)) >= 0) {}
+                else {
+                    if (*q == QUOTE_MARK && q + 1 < pend) q++;
+                    ok = *q++ == *n;
+                }
+                if (ok) { p = q; n++; continue; }
+            }
+        } else if (!*n) {
+            return 1;
+        }
+        if (!star_p || !*star_n) return 0;
+        p = star_p; // Let the last * take one more byte
+        n = ++star_n;
+    }
+}
+
+// Append one name to a listing being read.
+static int dir_add(struct dir_listing *d, size_t *ncap, size_t *nlen, size_t *ecap,
+                   const char *name, unsigned char type) {
+    size_t len = strlen(name) + 1;
+    if (arena_grow((void **)&d->names, ncap, *nlen + len, 1) < 0 ||
+        arena_grow((void **)&d->ents, ecap, d->n + 1, sizeof *d->ents) < 0) return -1;
+    memcpy(d->names + *nlen, name, len);
+    d->ents[d->n++] = (struct dir_entry){ *nlen, type };
+    *nlen += len;
+    return 0;
+}
+
+// Read directory `path` ("" = current) into the arena, or find it in the cache.
+static struct dir_listing *dir_list(const char *path) {
+    for (struct dir_listing *d = dir_cache; d; d = d->next)
+        if (strcmp(d->path, path) == 0) return d;
+
+    struct dir_listing *d = arena_alloc(&arena, sizeof *d);
+    char *copy = arena_alloc(&arena, strlen(path) + 1);
+    if (!d || !copy) return NULL;
+    *d = (struct dir_listing){ dir_cache, strcpy(copy, path), NULL, NULL, 0 };
+    dir_cache = d; // Unreadable directories are remembered too: they have no entries
+
+    size_t ncap = 0, nlen = 0, ecap = 0;
+    int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return d;
+#ifdef __linux__
+    // The kernel's own record layout, as getdents64(2) documents it.
+    struct linux_dirent64 {
+        unsigned long long d_ino;
+        long long d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+    static char *buf; // One batch of records, kept for the next listing
+    if (!buf && !(buf = malloc(GLOB_DIRBUF))) { close(fd); return d; }
+    long r;
+    while ((r = syscall(SYS_getdents64, fd, buf, GLOB_DIRBUF)) > 0)
+        for (long off = 0; off < r; ) {
+            struct linux_dirent64 *e = (struct linux_dirent64 *)(buf + off);
+            off += e->d_reclen;
+            if (dir_add(d, &ncap, &nlen, &ecap, e->d_name, e->d_type) < 0) { r = 0; break; }
+        }
+    close(fd);
+#else
+    DIR *dir = fdopendir(fd);
+    if (!dir) { close(fd); return d; }
+    for (struct dirent *e; (e = readdir(dir)); )
+        if (dir_add(d, &ncap, &nlen, &ecap, e->d_name, DT_UNKNOWN) < 0) break;
+    closedir(dir);
+#endif
+    return d;
+}
+
+static int str_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+struct glob_out { char **v; size_t n, cap; }; // Matches, in the arena
+
+// Expand the rest of the pattern, `pat`, below the directory already in
+// path[0..plen). `check`: path has literal parts nobody has seen exist yet.
+static void glob_rec(struct glob_out *g, char *path, size_t plen, const char *pat, int check) {
+    while (*pat == '/') { // Keep slashes as they are
+        if (plen + 1 >= GLOB_PATH_MAX) return;
+        path[plen++] = '/';
+        pat++;
+    }
+    path[plen] = '\0';
+    if (!*pat) {
+        struct stat sb;
+        if (check && fstatat(AT_FDCWD, path, &sb, AT_SYMLINK_NOFOLLOW) < 0) return;
+        char *m = arena_alloc(&arena, plen + 1);
+        if (m && arena_grow((void **)&g->v, &g->cap, g->n + 1, sizeof *g->v) == 0)
+            g->v[g->n++] = strcpy(m, path);
+        return;
+    }
+
+    const char *end = strchr(pat, '/');
+    if (!end) end = pat + strlen(pat);
+    if (!glob_bytes(pat, end)) { // A literal component: no need to list anything
+        for (const char *p = pat; p < end; p++) {
+            if (*p == QUOTE_MARK && p + 1 < end) p++;
+            if (plen + 1 >= GLOB_PATH_MAX) return;
+            path[plen++] = *p;
+        }
+        glob_rec(g, path, plen, end, 1);
+        return;
+    }
+
+    struct dir_listing *d = dir_list(path);
+    if (!d) return;
+    int dot_ok = *pat == '.' || (pat[0] == QUOTE_MARK && pat[1] == '.'); // Hidden names need an explicit .
+    for (size_t i = 0; i < d->n; i++) {
+        const char *name = d->names + d->ents[i].off;
+        if (name[0] == '.' && (!dot_ok || !name[1] || (name[1] == '.' && !name[2]))) continue; // Not . and .. either
+        if (!glob_match(pat, end, name)) continue;
+        size_t len = strlen(name);
+        if (plen + len + 1 >= GLOB_PATH_MAX) continue;
+        memcpy(path + plen, name, len + 1);
+        if (*end) { // More to come below it: it has to be a directory
+            unsigned char type = d->ents[i].type;
+            struct stat sb;
+            if (type == DT_UNKNOWN || type == DT_LNK) // Only these cost a stat()
+                type = stat(path, &sb) == 0 && S_ISDIR(sb.st_mode) ? DT_DIR : DT_UNKNOWN;
+            if (type != DT_DIR) continue;
+        }
+        glob_rec(g, path, plen + len, end, 0);
+    }
+}
+
+// Add the names matching pattern w to g, sorted. Returns how many were added.
+static size_t glob_word(struct glob_out *g, const char *w) {
+    char path[GLOB_PATH_MAX];
+    size_t before = g->n;
+    glob_rec(g, path, 0, w, 0);
+    qsort(g->v + before, g->n - before, sizeof *g->v, str_cmp);
+    return g->n - before;
+}
+
+// ------------------ Executable trie: every command in $PATH ------------------
+// Completing a command name needs every executable in $PATH, which can be
+// tens of thousands of files. Each $PATH directory is read once (with
+// dir_list() above) into a trie of names, and every name carries a bitmask
+// of the directories that have it. When a directory's mtime changes, say a
+// package was installed, only that directory is read again: its bit is
+// cleared from the names it had and set on the names it has now. The lowest
+// bit of a name also says where path_lookup() finds it, without a walk.
+// Directories past the 64th are left to path_search() and not completed.
+#define TRIE_MAX_DIRS 64
+
+struct trie_node {
+    uint32_t child;   // First child, 0 if none (node 0 is the root, never a child)
+    uint32_t sibling; // Next child of the same parent, in byte order
+    uint64_t dirs;    // Bit i: $PATH directory i has an executable by this name
+    unsigned char c;  // Last byte of the name
+};
+
+struct trie_dir {
+    char *path;            // "" for an empty $PATH entry, the current directory
+    struct timespec mtime; // When we read it
+    unsigned cwd_version;  // For relative directories: which directory that was
+    int seen;              // It existed when we read it
+    char *names;           // Executables found, NUL-terminated, back to back
+    size_t len;
+};
+
+static struct trie_node *trie;       // trie[0] is the root
+static uint32_t trie_n, trie_cap;
+static struct trie_dir trie_dirs[TRIE_MAX_DIRS];
+static int trie_ndirs;
+static char *trie_path;              // The $PATH it was built from, NULL = not built yet
+static unsigned long trie_checked;   // The line_seq it was last checked for
+static unsigned long line_seq;       // Bumped by repl() for every line read
+
+// Find (or add) the node for name[0..len).
+static uint32_t trie_find(const char *name, size_t len, int add) {
+    uint32_t node = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)name[i];
+        if (add && trie_n == trie_cap) {
+            uint32_t ncap = trie_cap ? trie_cap * 2 : 1024;
+            struct trie_node *t = realloc(trie, ncap * sizeof *t);
+            if (!t) return 0;
+            trie = t;
+            trie_cap = ncap;
+        }
+        uint32_t *link = &trie[node].child;
+        while (*link && trie[*link].c < c) link = &trie[*link].sibling;
+        if (!*link || trie[*link].c != c) {
+            if (!add) return 0;
+            trie[trie_n] = (struct trie_node){ 0, *link, 0, c };
+            *link = trie_n++;
+        }
+        node = *link;
+    }
+    return node;
+}
+
+// Set or clear directory i's bit on every name it had.
+static void trie_mark(int i, int on) {
+    struct trie_dir *d = &trie_dirs[i];
+    for (size_t off = 0; off < d->len; off += strlen(d->names + off) + 1) {
+        uint32_t node = trie_find(d->names + off, strlen(d->names + off), on);
+        if (!node) continue;
+        if (on) trie[node].dirs |= (uint64_t)1 << i;
+        else trie[node].dirs &= ~((uint64_t)1 << i);
+    }
+}
+
+// (Re)read directory i and keep the names of the executables in it.
+static void trie_scan(int i) {
+    struct trie_dir *d = &trie_dirs[i];
+    struct stat st;
+    d->len = 0;
+    d->seen = stat(*d->path ? d->path : ".", &st) == 0;
+    if (!d->seen) return;
+    d->mtime = st.st_mtim;
+    d->cwd_version = cwd_version;
+    struct dir_listing *l = dir_list(d->path);
+    int fd = open(*d->path ? d->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!l || fd < 0) { if (fd >= 0) close(fd); return; }
+    size_t cap = 0;
+    for (size_t k = 0; k < l->n; k++) {
+        const char *name = l->names + l->ents[k].off;
+        unsigned char type = l->ents[k].type;
+        if (name[0] == '.' || type == DT_DIR) continue;
+        if (faccessat(fd, name, X_OK, 0) != 0) continue;
+        if (type != DT_REG && (fstatat(fd, name, &st, 0) != 0 || !S_ISREG(st.st_mode))) continue;
+        size_t len = strlen(name) + 1;
+        if (d->len + len > cap) {
+            size_t ncap = cap ? cap * 2 : 4096;
+            while (ncap < d->len + len) ncap *= 2;
+            char *p = realloc(d->names, ncap);
+            if (!p) break;
+            d->names = p;
+            cap = ncap;
+        }
+        memcpy(d->names + d->len, name, len);
+        d->len += len;
+    }
+    close(fd);
+}
+
+// Bring the trie up to date with $PATH: at most once per command line, and
+// then only the directories that changed are read again.
+static void trie_refresh(const char *path) {
+    if (trie_path && trie_checked == line_seq && strcmp(path, trie_path) == 0) return;
+    dir_cache = NULL; // Listings from an earlier command may be stale by now
+    if (!trie_path || strcmp(path, trie_path) != 0) { // New $PATH: start over
+        for (int i = 0; i < trie_ndirs; i++) { free(trie_dirs[i].path); free(trie_dirs[i].names); }
+        memset(trie_dirs, 0, sizeof trie_dirs);
+        trie_ndirs = 0;
+        if (!trie_cap) { // Room for the root
+            if (!(trie = malloc(1024 * sizeof *trie))) return;
+            trie_cap = 1024;
+        }
+        trie[0] = (struct trie_node){ 0, 0, 0, 0 };
+        trie_n = 1;
+        free(trie_path);
+        trie_path = strdup(path);
+        if (!trie_path) return;
+        for (const char *dir = path; trie_ndirs < TRIE_MAX_DIRS; ) {
+            const char *end = strchr(dir, ':');
+            size_t dlen = end ? (size_t)(end - dir) : strlen(dir);
+            char *p = malloc(dlen + 1);
+            if (!p) break;
+            memcpy(p, dir, dlen);
+            p[dlen] = '\0';
+            trie_dirs[trie_ndirs++].path = p;
+            if (!end) break;
+            dir = end + 1;
+        }
+        for (int i = 0; i < trie_ndirs; i++) { trie_scan(i); trie_mark(i, 1); }
+    } else {
+        for (int i = 0; i < trie_ndirs; i++) {
+            struct trie_dir *d = &trie_dirs[i];
+            struct stat st;
+            int seen = stat(*d->path ? d->path : ".", &st) == 0;
+            if (seen == d->seen && (!seen || (st.st_mtim.tv_sec == d->mtime.tv_sec &&
+                                              st.st_mtim.tv_nsec == d->mtime.tv_nsec)) &&
+                (d->path[0] == '/' || d->cwd_version == cwd_version)) continue;
+            trie_mark(i, 0);
+            trie_scan(i);
+            trie_mark(i, 1);
+        }
+    }
+    trie_checked = line_seq;
+}
+
+// Where is command `name`? A malloc()ed path, or NULL to search $PATH the
+// slow way. Only used once completion has built the trie for this $PATH.
+static char *trie_where(const char *name, const char *path) {
+    if (!trie_path || strcmp(path, trie_path) != 0) return NULL;
+    trie_refresh(path);
+    uint32_t node = trie_find(name, strlen(name), 0);
+    if (!node || !trie[node].dirs) return NULL;
+    int i = 0;
+    while (!(trie[node].dirs >> i & 1)) i++;
+    const char *dir = *trie_dirs[i].path ? trie_dirs[i].path : ".";
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char *full = malloc(dlen + nlen + 2);
+    if (!full) return NULL;
+    memcpy(full, dir, dlen);
+    full[dlen] = '/';
+    memcpy(full + dlen + 1, name, nlen + 1);
+    struct stat st;
+    if (stat(full, &st) == 0 && S_ISREG(st.st_mode) && access(full, X_OK) == 0) return full;
+    free(full); // Changed under us without touching the directory, e.g. a chmod
+    return NULL;
+}
+
+// Call fn for every command name below `node`, in byte order; name[0..len)
+// holds the path down to it.
+static void trie_walk(uint32_t node, char *name, size_t len, size_t max,
+                      void (*fn)(const char *name, void *arg), void *arg) {
+    if (trie[node].dirs) { name[len] = '\0'; fn(name, arg); }
+    if (len + 1 >= max) return;
+    for (uint32_t c = trie[node].child; c; c = trie[c].sibling) {
+        name[len] = (char)trie[c].c;
+        trie_walk(c, name, len + 1, max, fn, arg);
+    }
+}
+
+// ------------------ Here-documents: <<WORD and <<<word ------------------
+// `cat <<EOF` reads the lines after the command, up to a line that is just
+// EOF, as its stdin; with <<- leading tabs are dropped from every line, so the
+// body can be indented along with the script. parse_line() reads those lines
+// right after tokenizing, from the same reader as the command, and collects
+// them in the arena; the body then stands in for WORD as the redirection's
+// target, so compiled scripts record it and expansion treats it like any
+// other word. With an unquoted WORD, $NAME and friends are expanded in the
+// body (\$ and \\ are escapes and a trailing \ joins two lines); a quoted
+// one, as in <<'EOF', leaves the body as it is. `<<<word` is the short form:
+// the expanded word and a newline.
+//
+// Right before the pipeline starts, each body becomes an fd and the
+// redirection an R_DUP of it: from there on it takes the path of `<&3`, a
+// posix_spawn file action (or dup2() for builtins and forked children), and
+// no file is ever written. Up to PIPE_BUF bytes fit in a pipe, which an empty
+// pipe always takes in one write(); larger bodies go into a memfd_create()
+// file, sealed so nothing can change it any more, and rewound.
+struct reader;
+static char *reader_line(struct reader *r, size_t *lenp); // See "Reading scripts"
+static int out_put(char **out, size_t *cap, size_t *len, const char *s, size_t n); // See "Expansion"
+
+// Read the body of the here-document whose WORD is token t from `more`,
+// and make it the token's text. Returns 0, or -1 if out of memory.
+static int heredoc_body(struct token *t, int tabs, struct reader *more) {
+    const char *word = unquote(t->text);
+    // Expanded: \ and QUOTE_MARK need care. Literal: $ and QUOTE_MARK get a QUOTE_MARK.
+    const char *special = t->quoted ? "$" "\001" : "\\" "\001";
+    char *body = NULL, *line;
+    size_t cap = 0, len = 0, n;
+    for (;;) {
+        if (!more || !(line = reader_line(more, &n))) {
+            fprintf(stderr, "mtsh: warning: here-document ended by end of file (wanted '%s')\n", word);
+            break;
+        }
+        if (tabs) while (*line == '\t') line++;
+        if (strcmp(line, word) == 0) break;
+        int join = 0;
+        for (const char *p = line; *p; ) {
+            size_t plain = strcspn(p, special);
+            if (out_put(&body, &cap, &len, p, plain) < 0) return -1;
+            p += plain;
+            if (!*p) break;
+            char pair[2] = { QUOTE_MARK, *p++ };
+            if (pair[1] == '\\') { // Only \$, \\ and a \ at the end mean something
+                if (!*p) { join = 1; break; }
+                if (*p == '$') pair[1] = *p++;
+                else if (*p == '\\') p++;
+                if (pair[1] == '\\') { if (out_put(&body, &cap, &len, "\\", 1) < 0) return -1; continue; }
+            }
+            if (out_put(&body, &cap, &len, pair, 2) < 0) return -1;
+        }
+        if (!join && out_put(&body, &cap, &len, "\n", 1) < 0) return -1;
+    }
+    if (!body && out_put(&body, &cap, &len, "", 0) < 0) return -1;
+    body[len] = '\0';
+    t->text = body;
+    return 0;
+}
+
+// Read the bodies of the here-documents in the tokens of `line`, in the order
+// they were written. Reading more lines may overwrite `line` (readers reuse
+// their buffer), so a line that has any is first copied to the arena.
+// Returns 0, or -1 after reporting an error.
+static int heredoc_bodies(struct tokvec *tv, char *line, struct reader *more) {
+    size_t i = 0;
+    while (i < tv->len && !(tv->v[i].kind == TK_REDIR && tv->v[i].op == R_HEREDOC)) i++;
+    if (i == tv->len) return 0; // Nearly always
+
+    size_t size = (size_t)(tv->end - line) + 1;
+    char *copy = arena_alloc(&arena, size);
+    if (!copy) { perror("mtsh"); return -1; }
+    memcpy(copy, line, size);
+    for (size_t k = 0; k < tv->len; k++) { // Words in the line move along; quoted ones are in the arena
+        uintptr_t at = (uintptr_t)tv->v[k].text;
+        if (tv->v[k].kind == TK_WORD && at >= (uintptr_t)line && at <= (uintptr_t)tv->end)
+            tv->v[k].text = copy + (at - (uintptr_t)line);
+    }
+    for (; i < tv->len; i++) {
+        if (tv->v[i].kind != TK_REDIR || tv->v[i].op != R_HEREDOC) continue;
+        if (i + 1 == tv->len || tv->v[i+1].kind != TK_WORD) return 0; // parse_pipeline() reports it
+        if (heredoc_body(&tv->v[i+1], tv->v[i].tabs, more) < 0) { perror("mtsh"); return -1; }
+    }
+    return 0;
+}
+
+// An fd that reads the `len` bytes at `text`, or -1 with errno set.
+static int heredoc_fd(const char *text, size_t len) {
+    if (len <= PIPE_BUF) {
+        int fds[2];
+        if (make_pipe(fds) < 0) return -1;
+        int bad = write_all(fds[1], text, len) < 0;
+        close(fds[1]);
+        if (!bad) return fds[0];
+        close(fds[0]);
+        return -1;
+    }
+#ifdef __linux__
+    int fd = memfd_create("mtsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    int fd = temp_fd(); // No memfd here: an unnamed file comes closest
+#endif
+    if (fd < 0) return -1;
+    if (write_all(fd, text, len) < 0 || lseek(fd, 0, SEEK_SET) < 0) { close(fd); return -1; }
+#ifdef __linux__
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+    return fd;
+}
+
+static void heredoc_close(int *fds, int n) {
+    while (n-- > 0) close(fds[n]);
+}
+
+// Turn the (expanded) here-documents and here-strings of a pipeline into
+// R_DUPs of fresh fds. Their numbers go to *fdsp, in the arena, for
+// heredoc_close() once the pipeline has started. Returns how many there
+// are, or -1 after reporting an error.
+static int heredoc_open(struct stage stages[], int n, int **fdsp) {
+    int count = 0;
+    for (int s = 0; s < n; s++)
+        for (int k = 0; k < stages[s].nredirs; k++) count += stages[s].redirs[k].op >= R_HEREDOC;
+    if (!count) return 0;
+    int *fds = arena_alloc(&arena, (size_t)count * sizeof *fds), nfds = 0;
+    if (!fds) { perror("mtsh"); return -1; }
+    for (int s = 0; s < n; s++) {
+        for (int k = 0; k < stages[s].nredirs; k++) {
+            struct redir *r = &stages[s].redirs[k];
+            if (r->op < R_HEREDOC) continue;
+            size_t len = strlen(r->target);
+            const char *text = r->target;
+            if (r->op == R_HERESTR) { // The word and a newline
+                char *str = arena_alloc(&arena, len + 2);
+                if (!str) { perror("mtsh"); heredoc_close(fds, nfds); return -1; }
+                memcpy(str, text, len);
+                str[len++] = '\n';
+                text = str;
+            }
+            int fd = heredoc_fd(text, len);
+            if (fd < 0) { perror("mtsh: here-document"); heredoc_close(fds, nfds); return -1; }
+            fds[nfds++] = fd;
+            r->op = R_DUP;
+            r->dupfd = fd;
+        }
+    }
+    *fdsp = fds;
+    return nfds;
+}
+
+// ------------------ Expansion ------------------
+// Words are expanded right before their pipeline runs, not when the line is
+// parsed: in `false; echo $?` the second `$?` must see the first command's status.
+
+// Append n bytes to the arena string being built in *out.
+static int out_put(char **out, size_t *cap, size_t *len, const char *s, size_t n) {
+    if (arena_grow((void **)out, cap, *len + n + 1, 1) < 0) return -1;
+    memcpy(*out + *len, s, n);
+    *len += n;
+    return 0;
+}
+
+// Expand one word: $NAME, ${NAME}, $? (last status), $$ (the shell's PID) and
+// $! (last background job's PID); an unset variable expands to nothing. Drops
+// the QUOTE_MARKs in front of quoted $, keeps those in front of quoted glob
+// bytes for glob_word(), and adds them in front of glob bytes in variable
+// values: those are never globbed. The result is always one word: there is
+// no splitting of expanded text on spaces.
+// Returns the word itself when there is nothing to do, which is nearly
+// always, else a new string in the arena.
+static char *expand_word(char *w) {
+    if (!strpbrk(w, "$" "\001")) return w;
+    char *out = NULL;
+    size_t cap = 0, len = 0;
+    for (const char *p = w; *p; ) {
+        size_t plain = strcspn(p, "$" "\001");
+        if (plain) { if (out_put(&out, &cap, &len, p, plain) < 0) return w; p += plain; continue; }
+        if (*p == QUOTE_MARK) {
+            size_t keep = p[1] == '$' ? 1 : 2; // A quoted $ has done its job
+            if (p[1] && out_put(&out, &cap, &len, p + 2 - keep, keep) < 0) return w;
+            p += p[1] ? 2 : 1;
+            continue;
+        }
+
+        const char *val = NULL, *name = p + 1;
+        size_t nl = 0, skip = 1; // Bytes of the $... reference
+        char num[24];
+        if (p[1] == '?' || p[1] == '$' || p[1] == '!') {
+            long n = p[1] == '?' ? last_status : p[1] == '$' ? (long)shell_pid : (long)last_bg_pid;
+            snprintf(num, sizeof num, "%ld", n);
+            val = p[1] == '!' && !last_bg_pid ? "" : num;
+            skip = 2;
+        } else if (p[1] == '{' && (nl = name_len(p + 2)) > 0 && p[2 + nl] == '}') {
+            name = p + 2;
+            skip = nl + 3;
+        } else if ((nl = name_len(p + 1)) > 0) {
+            skip = nl + 1;
+        }
+        if (skip == 1) { val = "$"; } // A lone $ stays itself
+        else if (!val) {
+            struct var *v = var_find(name, nl);
+            val = v ? v->entry + v->namelen + 1 : "";
+        }
+        for (const char *v = val; *v; ) {
+            size_t n = strcspn(v, "*?[" "\001");
+            if (out_put(&out, &cap, &len, v, n) < 0) return w;
+            if (!v[n]) break;
+            char quoted[2] = { QUOTE_MARK, v[n] };
+            if (out_put(&out, &cap, &len, quoted, 2) < 0) return w;
+            v += n + 1;
+        }
+        p += skip;
+    }
+    if (!out && out_put(&out, &cap, &len, "", 0) < 0) return w; // Expanded to nothing
+    out[len] = '\0';
+    return out;
+}
+
+// Expand all words of a stage. Globs can turn one word into many, so argv[]
+// is rebuilt in the arena when one does.
+static void expand_stage(struct stage *st) {
+    for (int i = 0; i < st->nassigns; i++) st->assigns[i] = unquote(expand_word(st->assigns[i]));
+
+    struct glob_out g = { 0 }; // The new argv[], once a glob has matched
+    for (int i = 0; st->argv[i]; i++) {
+        char *w = expand_word(st->argv[i]);
+        size_t matched = 0;
+        if (has_glob(w)) {
+            if (!g.v) { // Words so far stay as they are
+                if (arena_grow((void **)&g.v, &g.cap, (size_t)i + 1, sizeof *g.v) < 0) continue;
+                memcpy(g.v, st->argv, (size_t)i * sizeof *g.v);
+                g.n = (size_t)i;
+            }
+            matched = glob_word(&g, w);
+        }
+        if (matched) continue;
+        w = unquote(w); // No glob, or no match: the word itself, as in sh
+        if (!g.v) { st->argv[i] = w; continue; }
+        if (arena_grow((void **)&g.v, &g.cap, g.n + 1, sizeof *g.v) == 0) g.v[g.n++] = w;
+    }
+    if (g.v && arena_grow((void **)&g.v, &g.cap, g.n + 1, sizeof *g.v) == 0) {
+        g.v[g.n] = NULL;
+        st->argv = g.v;
+    }
+
+    for (int i = 0; i < st->nredirs; i++) { // > *.log: fine if it names exactly one file
+        char *w = expand_word((char *)st->redirs[i].target);
+        if (st->redirs[i].op >= R_HEREDOC) { st->redirs[i].target = unquote(w); continue; } // Text, not a name
+        struct glob_out one = { 0 };
+        st->redirs[i].target = has_glob(w) && glob_word(&one, w) == 1 ? one.v[0] : unquote(w);
+    }
+}
+
+// Run one expanded pipeline: a lone builtin right here in the shell (so `cd` and
+// friends take effect), anything else through run_pipeline().
+// A leading `time` word times the whole pipeline, like in other shells.
+// A `background` pipeline (cmd &) always gets processes, even a lone builtin.
+static int eval_expanded(struct stage stages[], int n, int background) {
+    int timed = opt_timing;
+    struct stage *st = &stages[0];
+    if (st->argv[0] && strcmp(st->argv[0], "time") == 0) {
+        timed = 1;
+        stages[0].argv++;
+        if (!stages[0].argv[0]) { // `time` alone, or `time | ...`
+            if (n > 1) { fprintf(stderr, "mtsh: syntax error near '|'\n"); return 2; }
+            return 0;
+        }
+    }
+
+    if (n == 1 && !background && !st->argv[0]) // NAME=value only: set them for good
+        return assign_vars(st->assigns, st->nassigns, NULL) < 0 ? 1 : 0;
+
+    if (n == 1 && !background && find_builtin(st->argv[0])) {
+        // NAME=value in front of a builtin holds while it runs
+        struct saved_var *save = arena_alloc(&arena, ((size_t)st->nassigns + 1) * sizeof *save);
+        if (!save || assign_vars(st->assigns, st->nassigns, save) < 0) { perror("mtsh"); return 1; }
+        struct timespec t0, t1;
+        struct rusage before, after, used, kids0, kids1, kids;
+        if (timed) {
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            getrusage(RUSAGE_SELF, &before);
+            getrusage(RUSAGE_CHILDREN, &kids0);
+        }
+        try_builtin(stages[0].argv, stages[0].redirs, stages[0].nredirs);
+        if (timed) {
+            getrusage(RUSAGE_SELF, &after);
+            getrusage(RUSAGE_CHILDREN, &kids1);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            rusage_delta(&used, &before, &after);
+            rusage_delta(&kids, &kids0, &kids1);
+            rusage_add(&used, &kids);
+            fflush(stdout); // Keep the report after the builtin's own output
+            report_timing(pipeline_text(stages, 1), &t0, &t1, &used);
+        }
+        restore_vars(save, st->nassigns);
+        return last_status;
+    }
+    return run_pipeline(stages, n, timed, background);
+}
+
+// Expand and run one parsed pipeline. Here-documents are open around that.
+static int eval_pipeline(struct stage stages[], int n, int background) {
+    dir_cache = NULL; // Directories may have changed since the last command
+    for (int i = 0; i < n; i++) expand_stage(&stages[i]);
+    int *fds = NULL, nfds = heredoc_open(stages, n, &fds);
+    if (nfds < 0) return 1;
+    int status = eval_expanded(stages, n, background);
+    heredoc_close(fds, nfds);
+    return status;
+}
+
+// ------------------ Command lists: a; b && c || d & ------------------
+// A line is parsed once into a small tree: a list of and-or chains, separated
+// by ; or &, each made of pipelines joined by && or ||. The evaluator walks
+// it without going back to the input, so a script line like
+// `cd build && make || echo failed; ls` is read, tokenized and parsed once.
+// && and || have the same precedence and group from the left, as in sh:
+// `false && a || b` skips a and runs b.
+
+struct pipeline {
+    struct stage *stages;
+    int nstages;
+    unsigned char op; // How it joins the previous pipeline: TK_AND, TK_OR (0 for the first)
+};
+
+struct and_or {
+    struct pipeline *pipes;
+    int npipes;
+    int background; // Ended by &
+};
+
+struct cmd_list {
+    struct and_or *cmds;
+    int ncmds;
+};
+
+// Parse a whole line. Returns 0, or -1 after reporting a syntax error.
+static int parse_list(struct token *tk, int ntok, struct cmd_list *list) {
+    int nsep = 0;
+    for (int i = 0; i < ntok; i++) nsep += tk[i].kind >= TK_AMP;
+    // At most nsep + 1 pipelines and chains; stages can not outnumber tokens.
+    struct pipeline *pipes = arena_alloc(&arena, ((size_t)nsep + 1) * sizeof *pipes);
+    struct stage *stages = arena_alloc(&arena, (size_t)ntok * sizeof *stages);
+    list->cmds = arena_alloc(&arena, ((size_t)nsep + 1) * sizeof *list->cmds);
+    list->ncmds = 0;
+    if (!pipes || !stages || !list->cmds) { perror("mtsh"); return -1; }
+
+    struct and_or *cur = NULL; // Chain still open (after && or ||)
+    unsigned char op = 0;
+    for (int i = 0, start = 0; i <= ntok; i++) {
+        if (i < ntok && tk[i].kind < TK_AMP) continue;
+        if (i == start) { // Nothing between two separators
+            if (i == ntok && !cur) return 0; // End of line, or a trailing ; or &
+            fprintf(stderr, "mtsh: syntax error near '%s'\n", i == ntok ? "newline" : token_names[tk[i].kind]);
+            return -1;
+        }
+        int n = parse_pipeline(tk + start, i - start, stages);
+        if (n < 0) return -1; // Already reported
+        if (!cur) {
+            cur = &list->cmds[list->ncmds++];
+            *cur = (struct and_or){ pipes, 0, 0 };
+        }
+        *pipes++ = (struct pipeline){ stages, n, op };
+        cur->npipes++;
+        stages += n;
+        if (i == ntok) return 0;
+
+        op = tk[i].kind;
+        if (op == TK_SEMI || op == TK_AMP) {
+            cur->background = op == TK_AMP;
+            cur = NULL;
+            op = 0;
+        }
+        start = i + 1;
+    }
+    return 0;
+}
+
+// Run an and-or chain, skipping what && and || say to skip.
+static int eval_and_or(const struct and_or *ao) {
+    for (int k = 0; k < ao->npipes && !exit_requested; k++) {
+        const struct pipeline *p = &ao->pipes[k];
+        if (p->op == TK_AND && last_status != 0) continue;
+        if (p->op == TK_OR && last_status == 0) continue;
+        last_status = eval_pipeline(p->stages, p->nstages, 0);
+    }
+    return last_status;
+}
+
+// `a && b &`: the whole chain runs in a subshell, which becomes the job.
+// A single pipeline needs no subshell, run_pipeline() starts it as a job itself.
+static int eval_background(const struct and_or *ao) {
+    if (ao->npipes == 1) return eval_pipeline(ao->pipes[0].stages, ao->pipes[0].nstages, 1);
+
+    size_t len = 1;
+    char **texts = arena_alloc(&arena, (size_t)ao->npipes * sizeof *texts);
+    if (!texts) { perror("mtsh"); return 1; }
+    for (int k = 0; k < ao->npipes; k++) {
+        texts[k] = pipeline_text(ao->pipes[k].stages, ao->pipes[k].nstages);
+        len += strlen(texts[k]) + 4;
+    }
+    char *cmd = arena_alloc(&arena, len);
+    if (!cmd) { perror("mtsh"); return 1; }
+    cmd[0] = '\0';
+    for (int k = 0; k < ao->npipes; k++) {
+        if (k) strcat(cmd, ao->pipes[k].op == TK_AND ? " && " : " || ");
+        strcat(cmd, texts[k]);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    n_forked += pid > 0; // For `stats`
+    if (pid < 0) { perror("fork"); return 1; }
+    if (pid == 0) {
+        zygote_detach();
+        exec_log_forked();
+        timeouts_forked();
+        threads_forked();
+        int null = open("/dev/null", O_RDONLY); // Same stdin as any background job
+        if (null >= 0) { dup2(null, STDIN_FILENO); if (null != STDIN_FILENO) close(null); }
+        eval_and_or(ao);
+        fflush(stdout);
+        exec_log_flush();
+        _exit(last_status);
+    }
+    last_bg_pid = pid; // $!
+    struct proc p = { pid, 0, 0, "mtsh", now_ns(), exec_log_start((char *[]){ "mtsh", "-c", cmd, NULL }, pid),
+                      0, 0, 0, 0, 0 };
+    struct job job = { .nprocs = 1, .nleft = 1, .procs = &p, .cmd = cmd, .pipefail = opt_pipefail };
+    struct job *j = job_adopt(&job);
+    if (j && isatty(STDIN_FILENO)) fprintf(stderr, "[%d] %ld\n", j->id, (long)pid);
+    return 0;
+}
+
+// Run a parsed line, one and-or chain after the other. $? follows along.
+static int eval_list(const struct cmd_list *list) {
+    for (int k = 0; k < list->ncmds && !exit_requested; k++) {
+        const struct and_or *ao = &list->cmds[k];
+        last_status = ao->background ? eval_background(ao) : eval_and_or(ao);
+    }
+    return last_status;
+}
+
+// ------------------ History: an append-only file with a trigram index ------------------
+// Every interactive command line is appended to $HISTFILE (default
+// ~/.mtsh_history) with one write() on an O_APPEND fd. The kernel appends
+// each write() as a whole, so any number of sessions can share the file
+// without locking it.
+//
+// Searches map the file read-only, together with an index kept next to it
+// in HISTFILE.idx: the offset of every line, and for each trigram (hashed
+// into one of HIST_BUCKETS buckets) the ascending list of lines containing
+// it. A search for "make inst" only verifies the lines in the shortest list
+// among its trigrams, instead of reading millions of lines. Lines appended
+// after the index was built are scanned directly; once that tail grows past
+// HIST_REINDEX bytes the index is rebuilt into a temporary file and
+// rename()d over the old one, so readers never see a half-written index.
+#define HIST_BUCKETS (1u << 16)
+#define HIST_REINDEX (256 * 1024)
+#define HIST_MAGIC "MTSHIDX1"
+
+struct hist_idx_header {  // Followed by off[nlines], start[HIST_BUCKETS + 1], post[]
+    char magic[8];
+    uint64_t covered;     // Bytes of the history file it describes
+    uint64_t nlines;      // Lines in those bytes
+    uint32_t nbuckets;
+    uint32_t unused;
+};
+
+struct hist {
+    const char *data;     // The history file, mapped read-only
+    size_t size;          // Up to the last complete line
+    void *idx;            // Its index, mapped read-only, or NULL
+    size_t idxsize;
+    const struct hist_idx_header *h;
+    const uint64_t *off;  // Start of each indexed line
+    const uint32_t *start, *post; // post[start[b] .. start[b+1]): lines with a trigram in bucket b
+};
+
+// Called for each match, oldest first, with the line's number (from 1).
+// Returns non-zero to stop the search.
+typedef int (*hist_fn)(size_t num, const char *line, size_t len, void *arg);
+
+static int hist_fd = -1;    // For appending
+static char *hist_path;     // malloc()ed
+
+static const char *hist_file(void) {
+    if (hist_path) return hist_path;
+    const char *f = var_get("HISTFILE"), *home = var_get("HOME");
+    if (f && *f) hist_path = strdup(f);
+    else if (home && (hist_path = malloc(strlen(home) + sizeof "/.mtsh_history")))
+        strcat(strcpy(hist_path, home), "/.mtsh_history");
+    return hist_path;
+}
+
+// Append one command line: a single write() of the line and its newline.
+static void hist_add(const char *line, size_t len) {
+    if (hist_fd < 0) {
+        const char *path = hist_file();
+        if (!path) return;
+        hist_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (hist_fd < 0) return; // No history then; not worth a message per command
+    }
+    struct iovec iov[2] = { { (void *)line, len }, { "\n", 1 } };
+    ssize_t r = writev(hist_fd, iov, 2);
+    (void)r;
+}
+
+static unsigned hist_bucket(const char *p) { return hash_bytes(p, 3) & (HIST_BUCKETS - 1); }
+
+// Write a fresh index for data[0..size) to `path`, via a temporary file.
+static int hist_build_index(const char *path, const char *data, size_t size) {
+    uint32_t *start = calloc(HIST_BUCKETS + 1, sizeof *start);
+    uint32_t *last = malloc(HIST_BUCKETS * sizeof *last); // Last line counted per bucket
+    uint64_t *off = NULL;
+    uint32_t *post = NULL;
+    int ret = -1;
+    if (!start || !last) goto out;
+
+    // Pass 1: count lines, and each line once per bucket it touches.
+    uint64_t nlines = 0;
+    memset(last, 0xff, HIST_BUCKETS * sizeof *last);
+    for (const char *p = data, *end = data + size; p < end; nlines++) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        for (const char *t = p; t + 3 <= nl; t++) {
+            unsigned b = hist_bucket(t);
+            if (last[b] != nlines) { last[b] = (uint32_t)nlines; start[b + 1]++; }
+        }
+        p = nl + 1;
+    }
+    for (unsigned b = 0; b < HIST_BUCKETS; b++) start[b + 1] += start[b];
+
+    // Pass 2: fill them in. fill[] reuses `last` as the next free slot per bucket.
+    off = malloc((nlines ? nlines : 1) * sizeof *off);
+    post = malloc((start[HIST_BUCKETS] ? start[HIST_BUCKETS] : 1) * sizeof *post);
+    uint32_t *fill = calloc(HIST_BUCKETS, sizeof *fill);
+    if (!off || !post || !fill) { free(fill); goto out; }
+    memset(last, 0xff, HIST_BUCKETS * sizeof *last);
+    uint64_t line = 0;
+    for (const char *p = data, *end = data + size; p < end; line++) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        off[line] = (uint64_t)(p - data);
+        for (const char *t = p; t + 3 <= nl; t++) {
+            unsigned b = hist_bucket(t);
+            if (last[b] != line) { last[b] = (uint32_t)line; post[start[b] + fill[b]++] = (uint32_t)line; }
+        }
+        p = nl + 1;
+    }
+    free(fill);
+
+    struct hist_idx_header h = { HIST_MAGIC, size, nlines, HIST_BUCKETS, 0 };
+    size_t tlen = strlen(path) + 32;
+    char *tmp = malloc(tlen);
+    if (!tmp) goto out;
+    snprintf(tmp, tlen, "%s.%ld", path, (long)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        int bad = write_all(fd, &h, sizeof h) < 0 ||
+                  write_all(fd, off, nlines * sizeof *off) < 0 ||
+                  write_all(fd, start, (HIST_BUCKETS + 1) * sizeof *start) < 0 ||
+                  write_all(fd, post, start[HIST_BUCKETS] * sizeof *post) < 0;
+        if (close(fd) < 0) bad = 1;
+        if (!bad && rename(tmp, path) == 0) ret = 0; // Atomic: readers see the old or the new one
+        else unlink(tmp);
+    }
+    free(tmp);
+out:
+    free(start); free(last); free(off); free(post);
+    return ret;
+}
+
+static void hist_close(struct hist *hs) {
+    if (hs->data) munmap((void *)hs->data, hs->size);
+    if (hs->idx) munmap(hs->idx, hs->idxsize);
+    memset(hs, 0, sizeof *hs);
+}
+
+// Does the index at m (size bytes) hang together, and describe the history in hs?
+// It lives in a directory the user can write to, next to a file that may be
+// rotated, so every offset is checked before a search trusts it.
+static int hist_index_ok(const struct hist *hs, const void *m, size_t size) {
+    const struct hist_idx_header *h = m;
+    if (memcmp(h->magic, HIST_MAGIC, 8) != 0 || h->nbuckets != HIST_BUCKETS || h->covered > hs->size)
+        return 0;
+    if (h->covered && hs->data[h->covered - 1] != '\n') return 0; // Truncated or rotated since
+    // Every line ends in a '\n', so nlines <= covered; that also keeps the sizes below from overflowing.
+    size_t room = (size - sizeof *h) / sizeof(uint64_t);
+    if (h->nlines > h->covered || h->nlines > room) return 0;
+    size_t want = sizeof *h + h->nlines * sizeof(uint64_t) + (HIST_BUCKETS + 1) * sizeof(uint32_t);
+    if (size < want || (size - want) % sizeof(uint32_t) != 0) return 0;
+    const uint64_t *off = (const uint64_t *)(h + 1);
+    const uint32_t *start = (const uint32_t *)(off + h->nlines);
+    if (start[0] != 0 || start[HIST_BUCKETS] != (size - want) / sizeof(uint32_t)) return 0;
+    for (unsigned b = 0; b < HIST_BUCKETS; b++) if (start[b] > start[b + 1]) return 0;
+    // Lines start at 0 and right after a '\n', in order; post[] is bounded in hist_search().
+    for (uint64_t i = 0; i < h->nlines; i++)
+        if (off[i] >= h->covered || (i == 0 ? off[i] != 0 : off[i] <= off[i - 1] || hs->data[off[i] - 1] != '\n'))
+            return 0;
+    return h->nlines > 0 || h->covered == 0;
+}
+
+// Map an index file and check that it still describes the history we mapped.
+static int hist_map_index(struct hist *hs, const char *ipath) {
+    int fd = open(ipath, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0) return -1;
+    if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof *hs->h) { close(fd); return -1; }
+    void *m = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+    if (!hist_index_ok(hs, m, (size_t)sb.st_size)) { // hist_open() builds a new one
+        munmap(m, (size_t)sb.st_size);
+        return -1;
+    }
+    const struct hist_idx_header *h = m;
+    hs->idx = m;
+    hs->idxsize = (size_t)sb.st_size;
+    hs->h = h;
+    hs->off = (const uint64_t *)(h + 1);
+    hs->start = (const uint32_t *)(hs->off + h->nlines);
+    hs->post = hs->start + HIST_BUCKETS + 1;
+    return 0;
+}
+
+// Map the history and its index, (re)building the index when it is missing
+// or too far behind. Returns 0, or -1 if there is no history to read.
+static int hist_open(struct hist *hs) {
+    memset(hs, 0, sizeof *hs);
+    const char *path = hist_file();
+    if (!path) return -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0) return -1;
+    if (fstat(fd, &sb) < 0 || sb.st_size == 0) { close(fd); return -1; }
+    void *m = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+    hs->data = m;
+    hs->size = (size_t)sb.st_size;
+    while (hs->size > 0 && hs->data[hs->size - 1] != '\n') hs->size--; // A line being written right now
+
+    size_t ilen = strlen(path) + 5;
+    char *ipath = malloc(ilen);
+    if (!ipath) return 0; // Searches still work, just without the index
+    snprintf(ipath, ilen, "%s.idx", path);
+    if (hist_map_index(hs, ipath) < 0 || hs->size - hs->h->covered > HIST_REINDEX) {
+        if (hs->idx) { munmap(hs->idx, hs->idxsize); hs->idx = NULL; hs->h = NULL; }
+        if (hist_build_index(ipath, hs->data, hs->size) == 0) hist_map_index(hs, ipath);
+    }
+    free(ipath);
+    return 0;
+}
+
+static const char *find_bytes(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+    if (nlen == 0) return hay;
+    for (const char *end = hay + hlen; (size_t)(end - hay) >= nlen; hay++) {
+        hay = memchr(hay, needle[0], (size_t)(end - hay) - nlen + 1);
+        if (!hay) return NULL;
+        if (memcmp(hay, needle, nlen) == 0) return hay;
+    }
+    return NULL;
+}
+
+static int hist_line_matches(const char *line, size_t len, const char *needle, size_t nlen, int prefix) {
+    if (prefix) return len >= nlen && memcmp(line, needle, nlen) == 0;
+    return find_bytes(line, len, needle, nlen) != NULL;
+}
+
+// Scan data[from..to) line by line; lines are numbered from `num`.
+static int hist_scan(const struct hist *hs, size_t from, size_t to, size_t num,
+                     const char *needle, int prefix, hist_fn fn, void *arg) {
+    size_t nlen = strlen(needle);
+    for (const char *p = hs->data + from, *end = hs->data + to; p < end; num++) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        size_t len = (size_t)(nl - p);
+        if (hist_line_matches(p, len, needle, nlen, prefix) && fn(num, p, len, arg)) return 1;
+        p = nl + 1;
+    }
+    return 0;
+}
+
+// Call fn for every history line containing needle (or starting with it, if
+// `prefix`), oldest first. An empty needle matches every line.
+static void hist_search(const struct hist *hs, const char *needle, int prefix, hist_fn fn, void *arg) {
+    size_t nlen = strlen(needle), covered = hs->h ? hs->h->covered : 0;
+    if (hs->h && nlen >= 3) {
+        // The shortest posting list among the needle's trigrams is our candidate set.
+        unsigned best = hist_bucket(needle);
+        for (size_t i = 1; i + 3 <= nlen; i++) {
+            unsigned b = hist_bucket(needle + i);
+            if (hs->start[b + 1] - hs->start[b] < hs->start[best + 1] - hs->start[best]) best = b;
+        }
+        for (uint32_t k = hs->start[best]; k < hs->start[best + 1]; k++) {
+            uint32_t line = hs->post[k];
+            if (line >= hs->h->nlines) break; // A corrupt list: the lines after the index are still scanned
+            size_t from = hs->off[line];
+            size_t to = line + 1 < hs->h->nlines ? hs->off[line + 1] : covered;
+            if (hist_line_matches(hs->data + from, to - from - 1, needle, nlen, prefix) &&
+                fn(line + 1, hs->data + from, to - from - 1, arg)) return;
+        }
+    } else if (hist_scan(hs, 0, covered, 1, needle, prefix, fn, arg)) {
+        return;
+    }
+    hist_scan(hs, covered, hs->size, hs->h ? hs->h->nlines + 1 : 1, needle, prefix, fn, arg);
+}
+
+static int hist_print(size_t num, const char *line, size_t len, void *arg) {
+    (void)arg;
+    printf("%5zu  %.*s\n", num, (int)len, line);
+    return 0;
+}
+
+struct hist_tail { size_t total, first; }; // For `history N`
+
+static int hist_count(size_t num, const char *line, size_t len, void *arg) {
+    (void)line; (void)len;
+    ((struct hist_tail *)arg)->total = num;
+    return 0;
+}
+
+static int hist_print_from(size_t num, const char *line, size_t len, void *arg) {
+    if (num >= ((struct hist_tail *)arg)->first) hist_print(num, line, len, NULL);
+    return 0;
+}
+
+// history [N]          the last N lines (all of them without N)
+// history -s TEXT      lines containing TEXT
+// history -p TEXT      lines starting with TEXT
+static int builtin_history(char *argv[]) {
+    struct hist hs;
+    if (hist_open(&hs) < 0) return 0; // No history yet
+    int status = 0;
+    if (argv[1] && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "-p") == 0)) {
+        if (!argv[2]) { fprintf(stderr, "history: %s: expected a search text\n", argv[1]); status = 2; }
+        else hist_search(&hs, argv[2], argv[1][1] == 'p', hist_print, NULL);
+    } else if (argv[1]) {
+        char *end;
+        long n = strtol(argv[1], &end, 10);
+        if (*end || n < 0) { fprintf(stderr, "history: %s: expected a number\n", argv[1]); status = 2; }
+        else {
+            struct hist_tail t = { 0, 0 };
+            if (hs.h) { // The index knows how many lines it covers
+                t.total = hs.h->nlines;
+                hist_scan(&hs, hs.h->covered, hs.size, t.total + 1, "", 0, hist_count, &t);
+            } else {
+                hist_scan(&hs, 0, hs.size, 1, "", 0, hist_count, &t);
+            }
+            t.first = t.total > (size_t)n ? t.total - (size_t)n + 1 : 1;
+            // Start reading at the first line we print, not at the top
+            size_t from = 0, num = 1;
+            if (hs.h && t.first <= hs.h->nlines) { from = hs.off[t.first - 1]; num = t.first; }
+            else if (hs.h) { from = hs.h->covered; num = hs.h->nlines + 1; }
+            hist_scan(&hs, from, hs.size, num, "", 0, hist_print_from, &t);
+        }
+    } else {
+        hist_search(&hs, "", 0, hist_print, NULL);
+    }
+    hist_close(&hs);
+    return status;
+}
+
+// Tokenize and parse one line of `len` bytes into *list, reading the bodies of its
+// here-documents from `more` (NULL: there are no more lines). Returns the number
+// of and-or chains (0 for a line that is only whitespace or a comment), or -1
+// after reporting an error.
+static int parse_line(char *line, size_t len, struct cmd_list *list, struct reader *more) {
+    struct tokvec tokens;
+    int ntok = tokenize(line, len, &tokens); // Split the line into words and operators.
+    // tokenize() modifies the input line, so the words point to parts of the same memory.
+    // Note: tokenize() returns the number of tokens, or -1 if the line was refused
+    // (more words than exec() could ever take, i.e. more than ARG_MAX).
+    // If it is 0, the line was empty, or contained only whitespace or a comment.
+    if (ntok <= 0) return ntok;
+    if (heredoc_bodies(&tokens, line, more) < 0) return -1; // The lines after this one, for <<WORD
+
+    // ------------------ Lists, pipeline stages and redirections ------------------
+    // Each stage gets its own argv[]: the command itself followed by its
+    // options/arguments and a NULL, which is required for execv() to know
+    // where the arguments end. Redirections go into the stage's redirs[].
+    // Stages make pipelines, pipelines make and-or chains, see parse_list().
+    if (parse_list(tokens.v, ntok, list) < 0) return -1;
+    return list->ncmds;
+}
+
+// ------------------ Reading scripts: blocks, not lines ------------------
+// getline() copies every line out of stdio's buffer, and chomp() then walks it
+// again with strlen() for the '\n'. Batch input is read differently: a script
+// or a pipe is read() READER_BLOCK bytes at a time, a -c string is used where
+// it is. memchr() finds the end of each line, the '\n' there becomes the '\0'
+// the rest of the shell expects, and the line is handed out in place with its
+// length: no copy, no second pass. The length goes along to parse_line() and
+// the tokenizer, so nothing measures the line with strlen() again. A terminal
+// is a reader too (one with a prompt), only one that gets its lines from
+// edit_line() or getline(), so the rest of the shell, here-documents
+// included, reads every kind of input alike.
+//
+// Why not mmap() script files? The tokenizer writes '\0's into the line, so
+// the mapping has to be private and every page of it takes a copy-on-write
+// fault; on a 1M-line script that was slower than read() into one reused buffer.
+#define READER_BLOCK (64 * 1024)
+
+struct reader {
+    int fd;           // Where read() gets more, -1 for a string
+    char *buf;
+    size_t len, pos;  // Bytes in buf, start of the next line
+    size_t cap;       // Size of buf, 0 for a string
+    int eof;          // read() has returned 0
+    const char *prompt; // A terminal: prompt for each line, see reader_tty()
+};
+
+static void reader_open(struct reader *r, int fd) {
+    memset(r, 0, sizeof *r);
+    r->fd = fd;
+}
+
+// Read the string `s` (a -c argument, which we may write into).
+static void reader_string(struct reader *r, char *s) {
+    memset(r, 0, sizeof *r);
+    r->fd = -1;
+    r->buf = s;
+    r->len = strlen(s);
+}
+
+static void reader_close(struct reader *r) {
+    if (r->cap) free(r->buf);
+    memset(r, 0, sizeof *r);
+    r->fd = -1;
+}
+
+static ssize_t edit_line(const char *prompt, char **buf, size_t *cap); // See "Line editing"
+
+// A line typed at the terminal, without its '\n'; NULL at EOF.
+static char *reader_tty(struct reader *r, size_t *lenp) {
+    ssize_t n;
+    if (isatty(STDOUT_FILENO)) {
+        n = edit_line(r->prompt, &r->buf, &r->cap); // With Tab completion
+    } else {
+        printf("%s", r->prompt);
+        fflush(stdout); // Ensure prompt is printed before reading input
+        n = getline(&r->buf, &r->cap, stdin); // Read a line from the input.
+        if (n > 0) chomp(r->buf); // Remove trailing newline, see its definition above.
+    }
+    // ssize_t is a signed type for sizes, defined in <sys/types.h> which is included via <unistd.h>,
+    // getline() expects this type for its return value.
+    // cap = capacity in bytes of the line buffer, getline() will reuse it on subsequent calls,
+    // and resize it if it's too small.
+    if (n < 0) return NULL;
+    *lenp = strlen(r->buf);
+    return r->buf;
+}
+
+// The next line, NUL-terminated in place, with its length in *lenp; NULL at
+// EOF. It stays valid until the next call.
+static char *reader_line(struct reader *r, size_t *lenp) {
+    if (r->prompt) return reader_tty(r, lenp);
+    for (;;) {
+        char *start = r->buf + r->pos;
+        size_t left = r->len - r->pos;
+        char *nl = left ? memchr(start, '\n', left) : NULL;
+        if (nl) {
+            *nl = '\0';
+            *lenp = (size_t)(nl - start);
+            r->pos += *lenp + 1;
+            return start;
+        }
+        if (r->fd < 0 || r->eof) { // A last line without a '\n', or the end
+            if (!left) return NULL;
+            start[left] = '\0'; // The string's own NUL, or the byte kept free in buf
+            r->pos = r->len;
+            *lenp = left;
+            return start;
+        }
+        // Keep the partial line, moved to the front, and read() more after it.
+        if (r->pos) {
+            memmove(r->buf, start, left);
+            r->len = left;
+            r->pos = 0;
+        }
+        if (r->len + 1 >= r->cap) { // Too long a line: grow, always keeping a byte for the '\0'
+            size_t ncap = r->cap ? r->cap * 2 : READER_BLOCK + 1;
+            char *p = realloc(r->buf, ncap);
+            if (!p) { perror("mtsh: read"); return NULL; }
+            r->buf = p;
+            r->cap = ncap;
+        }
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - 1 - r->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) perror("mtsh: read");
+        if (n <= 0) r->eof = 1;
+        else r->len += (size_t)n;
+    }
+}
+
+// ------------------ Compiled scripts: parse once, run many times ------------------
+// A script is tokenized and parsed line by line as it runs. While that
+// happens, each parsed line is also written down in a flat form: numbers
+// for the structure and offsets into a string pool for the words. After a
+// run without syntax errors the result is saved under ~/.cache/mtsh/scripts
+// ($XDG_CACHE_HOME), in a file named after the script's full path that also
+// records its device, inode, size and mtime and the mtsh build that wrote it.
+// The next run of an unchanged script mmap()s that file and turns each line
+// back into the structs eval_list() takes, which is only pointer setup: no
+// tokenizing, no parsing. The mapping is private, so expansion may write to
+// the words without touching the file.
+#define SC_MAGIC "MTSHSC01"
+#define SC_BUILD __DATE__ " " __TIME__ // Any rebuild may change the structs
+#define SC_NONE 0xffffffffu            // A string that is not there (NULL)
+
+struct sc_header {   // Followed by path[pathlen + 1] (padded to 4 bytes), code[ncode], strings[nstr]
+    char magic[8];
+    char build[24];
+    uint64_t dev, ino, size;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t nlines; // Lines that had commands
+    uint64_t ncode;  // uint32_t words
+    uint64_t nstr;   // Bytes
+    uint32_t pathlen;
+    uint32_t unused;
+};
+
+// Per line: ncmds, then per chain: npipes, background, then per pipeline:
+// nstages, op, then per stage: argc, nassigns, nredirs, the argv and assigns
+// string offsets, and fd, op, dupfd, target offset for each redirection.
+struct sc_rec {
+    uint32_t *code;
+    size_t ncode, codecap;
+    char *str;
+    size_t nstr, strcap;
+    uint64_t nlines;
+    int bad;         // A line failed to parse (or we ran out of memory): do not save
+    struct stat st;  // The script when we opened it
+};
+
+static struct sc_rec *sc_rec; // Recording the script being run, see repl()
+
+static void sc_word(struct sc_rec *r, uint32_t w) {
+    if (r->ncode == r->codecap) {
+        size_t ncap = r->codecap ? r->codecap * 2 : 1024;
+        uint32_t *p = realloc(r->code, ncap * sizeof *p);
+        if (!p) { r->bad = 1; return; }
+        r->code = p;
+        r->codecap = ncap;
+    }
+    r->code[r->ncode++] = w;
+}
+
+static void sc_string(struct sc_rec *r, const char *s) {
+    if (!s) { sc_word(r, SC_NONE); return; }
+    size_t n = strlen(s) + 1;
+    if (r->nstr + n > r->strcap) {
+        size_t ncap = r->strcap ? r->strcap * 2 : 4096;
+        while (ncap < r->nstr + n) ncap *= 2;
+        char *p = realloc(r->str, ncap);
+        if (!p) { r->bad = 1; return; }
+        r->str = p;
+        r->strcap = ncap;
+    }
+    sc_word(r, (uint32_t)r->nstr);
+    memcpy(r->str + r->nstr, s, n);
+    r->nstr += n;
+}
+
+// Write down one parsed line. Must run before eval_list() expands it.
+static void sc_record(struct sc_rec *r, const struct cmd_list *l) {
+    r->nlines++;
+    sc_word(r, (uint32_t)l->ncmds);
+    for (int c = 0; c < l->ncmds; c++) {
+        const struct and_or *ao = &l->cmds[c];
+        sc_word(r, (uint32_t)ao->npipes);
+        sc_word(r, (uint32_t)ao->background);
+        for (int p = 0; p < ao->npipes; p++) {
+            const struct pipeline *pl = &ao->pipes[p];
+            sc_word(r, (uint32_t)pl->nstages);
+            sc_word(r, pl->op);
+            for (int s = 0; s < pl->nstages; s++) {
+                const struct stage *st = &pl->stages[s];
+                uint32_t argc = 0;
+                while (st->argv[argc]) argc++;
+                sc_word(r, argc);
+                sc_word(r, (uint32_t)st->nassigns);
+                sc_word(r, (uint32_t)st->nredirs);
+                for (uint32_t k = 0; k < argc; k++) sc_string(r, st->argv[k]);
+                for (int k = 0; k < st->nassigns; k++) sc_string(r, st->assigns[k]);
+                for (int k = 0; k < st->nredirs; k++) {
+                    const struct redir *rd = &st->redirs[k];
+                    sc_word(r, (uint32_t)rd->fd);
+                    sc_word(r, rd->op);
+                    sc_word(r, (uint32_t)rd->dupfd);
+                    sc_string(r, rd->target);
+                }
+            }
+        }
+    }
+}
+
+struct sc_reader {
+    const uint32_t *pc, *end;
+    char *str;    // In the private mapping
+    size_t nstr;
+    int bad;
+};
+
+static uint32_t sc_next(struct sc_reader *rd) {
+    if (rd->pc == rd->end) { rd->bad = 1; return 0; }
+    return *rd->pc++;
+}
+
+static char *sc_next_str(struct sc_reader *rd) {
+    uint32_t off = sc_next(rd);
+    if (off == SC_NONE) return NULL;
+    if (off >= rd->nstr) { rd->bad = 1; return NULL; }
+    return rd->str + off;
+}
+
+// Counts come from our own file, but a damaged file must not make us
+// allocate wildly: nothing can outnumber the words left in the code.
+static void *sc_array(struct sc_reader *rd, uint32_t n, size_t size) {
+    if (n > (size_t)(rd->end - rd->pc) + 1) { rd->bad = 1; return NULL; }
+    void *p = arena_alloc(&arena, ((size_t)n + 1) * size);
+    if (!p) rd->bad = 1;
+    return p;
+}
+
+// Rebuild one line's structs in the arena. Returns 0, or -1 if the file is damaged.
+static int sc_decode(struct sc_reader *rd, struct cmd_list *l) {
+    l->ncmds = (int)sc_next(rd);
+    l->cmds = sc_array(rd, (uint32_t)l->ncmds, sizeof *l->cmds);
+    for (int c = 0; !rd->bad && c < l->ncmds; c++) {
+        struct and_or *ao = &l->cmds[c];
+        ao->npipes = (int)sc_next(rd);
+        ao->background = (int)sc_next(rd);
+        ao->pipes = sc_array(rd, (uint32_t)ao->npipes, sizeof *ao->pipes);
+        for (int p = 0; !rd->bad && p < ao->npipes; p++) {
+            struct pipeline *pl = &ao->pipes[p];
+            pl->nstages = (int)sc_next(rd);
+            pl->op = (unsigned char)sc_next(rd);
+            pl->stages = sc_array(rd, (uint32_t)pl->nstages, sizeof *pl->stages);
+            for (int s = 0; !rd->bad && s < pl->nstages; s++) {
+                struct stage *st = &pl->stages[s];
+                uint32_t argc = sc_next(rd);
+                st->nassigns = (int)sc_next(rd);
+                st->nredirs = (int)sc_next(rd);
+                st->argv = sc_array(rd, argc, sizeof *st->argv);
+                st->assigns = sc_array(rd, (uint32_t)st->nassigns, sizeof *st->assigns);
+                st->redirs = sc_array(rd, (uint32_t)st->nredirs, sizeof *st->redirs);
+                if (rd->bad) break;
+                for (uint32_t k = 0; k < argc; k++) st->argv[k] = sc_next_str(rd);
+                st->argv[argc] = NULL;
+                for (int k = 0; k < st->nassigns; k++) st->assigns[k] = sc_next_str(rd);
+                for (int k = 0; k < st->nredirs; k++) {
+                    struct redir *r = &st->redirs[k];
+                    r->fd = (int)sc_next(rd);
+                    r->op = (unsigned char)sc_next(rd);
+                    r->dupfd = (int)sc_next(rd);
+                    r->target = sc_next_str(rd);
+                    if (r->op > R_HERESTR || !r->target) rd->bad = 1;
+                }
+            }
+        }
+    }
+    return rd->bad ? -1 : 0;
+}
+
+// Where the compiled form of `script` lives. Returns 0, or -1.
+static int sc_path(const char *script, char *buf, size_t size) {
+    char *full = realpath(script, NULL), *dir = cache_dir("scripts");
+    int ok = full && dir;
+    if (ok) cache_entry(buf, size, dir, full, strlen(full));
+    free(full);
+    free(dir);
+    return ok ? 0 : -1;
+}
+
+// Run `script` (opened as `script_fd`) from its compiled form, if there is a
+// valid one. Returns 1 if it ran, else 0, with sc_rec set up to record this run.
+static int sc_run(const char *script, int script_fd) {
+    static struct sc_rec rec;
+    char path[4200];
+    if (fstat(script_fd, &rec.st) < 0 || !S_ISREG(rec.st.st_mode) || sc_path(script, path, sizeof path) < 0)
+        return 0; // Nothing to key a cache on (a pipe, say), or nowhere to keep it
+    sc_rec = &rec; // From here on, a miss records
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct sc_header)) { close(fd); return 0; }
+    size_t size = (size_t)st.st_size;
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    const struct sc_header *h = (const struct sc_header *)map;
+    size_t code_at = (sizeof *h + h->pathlen + 1 + 3) & ~(size_t)3;
+    if (memcmp(h->magic, SC_MAGIC, 8) != 0 || strncmp(h->build, SC_BUILD, sizeof h->build) != 0 ||
+        h->dev != (uint64_t)rec.st.st_dev || h->ino != (uint64_t)rec.st.st_ino ||
+        h->size != (uint64_t)rec.st.st_size || h->mtime_sec != (int64_t)rec.st.st_mtim.tv_sec ||
+        h->mtime_nsec != (int64_t)rec.st.st_mtim.tv_nsec || h->pathlen >= size ||
+        h->ncode > size / 4 || h->nstr > size ||
+        code_at + h->ncode * 4 + h->nstr != size || (h->nstr && map[size - 1] != '\0')) {
+        munmap(map, size); // Stale or not ours: this run records a new one
+        return 0;
+    }
+    sc_rec = NULL;
+
+    struct sc_reader rd = { (const uint32_t *)(map + code_at), (const uint32_t *)(map + code_at) + h->ncode,
+                            map + code_at + h->ncode * 4, h->nstr, 0 };
+    for (uint64_t n = 0; n < h->nlines; n++) {
+        reap_children(); // As in repl()
+        notify_jobs(0);
+        arena_reset(&arena);
+        struct cmd_list list;
+        uint64_t t0 = now_ns();
+        int bad = sc_decode(&rd, &list) < 0;
+        lat_add(&phases[PH_PARSE], now_ns() - t0); // Decoding stands in for parsing
+        if (bad) { fprintf(stderr, "mtsh: %s: damaged cache, remove it\n", path); break; }
+        last_status = eval_list(&list);
+        if (exit_requested) break;
+    }
+    munmap(map, size);
+    arena_free(&arena);
+    return 1;
+}
+
+// Save what this run recorded. Lines after an `exit` never ran, so they are
+// parsed here first: the cache has to cover the whole script.
+static void sc_save(const char *script, struct reader *in) {
+    struct sc_rec *r = sc_rec;
+    char *line;
+    size_t len;
+    while (!r->bad && (line = reader_line(in, &len))) {
+        arena_reset(&arena);
+        struct cmd_list list;
+        int n = parse_line(line, len, &list, in);
+        if (n < 0) r->bad = 1;
+        else if (n > 0) sc_record(r, &list);
+    }
+    arena_free(&arena);
+
+    char path[4200], tmp[4250];
+    if (r->bad || sc_path(script, path, sizeof path) < 0) return;
+    char *full = realpath(script, NULL);
+    if (!full) return;
+    struct sc_header h = { SC_MAGIC, SC_BUILD, (uint64_t)r->st.st_dev, (uint64_t)r->st.st_ino,
+                           (uint64_t)r->st.st_size, (int64_t)r->st.st_mtim.tv_sec,
+                           (int64_t)r->st.st_mtim.tv_nsec, r->nlines, r->ncode, r->nstr,
+                           (uint32_t)strlen(full), 0 };
+    snprintf(tmp, sizeof tmp, "%s.%ld", path, (long)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        size_t pad = ((sizeof h + h.pathlen + 1 + 3) & ~(size_t)3) - sizeof h - h.pathlen;
+        int bad = write_all(fd, &h, sizeof h) < 0 || write_all(fd, full, h.pathlen) < 0 ||
+                  write_all(fd, "\0\0\0\0", pad) < 0 ||
+                  write_all(fd, r->code, r->ncode * sizeof *r->code) < 0 ||
+                  write_all(fd, r->str, r->nstr) < 0;
+        if (close(fd) < 0 || bad || rename(tmp, path) < 0) unlink(tmp);
+    }
+    free(full);
+}
+
+// ------------------ Line editing and tab completion ------------------
+// On a terminal we read keys ourselves instead of using getline(): the
+// terminal is put in raw mode while a line is being typed, so Tab can
+// complete the word before the cursor. In command position it completes
+// builtins and everything in $PATH (from the trie above), elsewhere file
+// names. One match is filled in; several are filled in up to their common
+// prefix, and a Tab that adds nothing lists them. The terminal goes back to
+// normal before the line runs, so commands see it the way they expect.
+// Other keys: arrows, Home/End, Backspace/Delete, Ctrl-A/E/B/F, Ctrl-K/U/W,
+// Ctrl-L, Ctrl-C (drop the line) and Ctrl-D (EOF on an empty line).
+#define COMPL_LIST_MAX 200 // Matches listed at most
+
+struct compl {
+    char **v;
+    size_t n, cap;
+    size_t typed;  // Bytes of each match already in the line
+};
+
+static void compl_add(const char *name, void *arg) {
+    struct compl *c = arg;
+    if (c->n == c->cap) {
+        size_t ncap = c->cap ? c->cap * 2 : 64;
+        char **v = realloc(c->v, ncap * sizeof *v);
+        if (!v) return;
+        c->v = v;
+        c->cap = ncap;
+    }
+    if ((c->v[c->n] = strdup(name))) c->n++;
+}
+
+// Commands starting with word[0..len): builtins and $PATH (through the trie).
+static void compl_commands(struct compl *c, const char *word, size_t len) {
+    for (size_t i = 0; i < sizeof builtins / sizeof builtins[0]; i++)
+        if (strncmp(builtins[i].name, word, len) == 0) compl_add(builtins[i].name, c);
+    const char *path = var_get("PATH");
+    trie_refresh(path ? path : "/usr/local/bin:/usr/bin:/bin");
+    if (!trie_path) return;
+    uint32_t node = trie_find(word, len, 0);
+    char name[256];
+    if ((node || len == 0) && len < sizeof name) {
+        memcpy(name, word, len);
+        trie_walk(node, name, len, sizeof name, compl_add, c);
+    }
+}
+
+// Files whose path starts with word[0..len); directories get a '/'.
+static void compl_files(struct compl *c, const char *word, size_t len) {
+    const char *slash = NULL;
+    for (const char *p = word; p < word + len; p++) if (*p == '/') slash = p;
+    char dir[GLOB_PATH_MAX];
+    size_t dlen = slash ? (size_t)(slash - word) + (slash == word) : 0; // Keep "/" itself
+    if (dlen >= sizeof dir) return;
+    memcpy(dir, word, dlen);
+    dir[dlen] = '\0';
+    const char *base = slash ? slash + 1 : word;
+    size_t blen = (size_t)(word + len - base);
+    c->typed = blen;
+    dir_cache = NULL; // Always list afresh
+    struct dir_listing *l = dir_list(dir);
+    for (size_t k = 0; l && k < l->n; k++) {
+        const char *name = l->names + l->ents[k].off;
+        if (strncmp(name, base, blen) != 0) continue;
+        if (name[0] == '.' && (blen == 0 || base[0] != '.')) continue; // Hidden unless asked for
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        char tmp[GLOB_PATH_MAX];
+        int isdir = l->ents[k].type == DT_DIR;
+        if (l->ents[k].type == DT_UNKNOWN || l->ents[k].type == DT_LNK) {
+            struct stat st;
+            snprintf(tmp, sizeof tmp, "%s%s%s", dir, dlen && dir[dlen-1] != '/' ? "/" : "", name);
+            isdir = stat(tmp, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (!isdir) { compl_add(name, c); continue; }
+        snprintf(tmp, sizeof tmp, "%s/", name);
+        compl_add(tmp, c);
+    }
+}
+
+struct edit {
+    char **buf;         // The caller's line buffer ...
+    size_t *cap;        // ... and its size, grown as needed
+    size_t len, pos;    // Bytes in the line, cursor position
+    const char *prompt;
+};
+
+static void edit_refresh(const struct edit *e) {
+    char tail[32];
+    int n = e->pos < e->len ? snprintf(tail, sizeof tail, "\x1b[%zuD", e->len - e->pos) : 0;
+    struct iovec iov[5] = {
+        { "\r", 1 }, { (void *)e->prompt, strlen(e->prompt) }, { *e->buf, e->len },
+        { "\x1b[K", 3 }, { tail, (size_t)n },
+    };
+    ssize_t r = writev(STDOUT_FILENO, iov, 5);
+    (void)r;
+}
+
+static int edit_insert(struct edit *e, const char *s, size_t n) {
+    if (e->len + n + 1 > *e->cap) {
+        size_t ncap = *e->cap ? *e->cap * 2 : 128;
+        while (ncap < e->len + n + 1) ncap *= 2;
+        char *p = realloc(*e->buf, ncap);
+        if (!p) return -1;
+        *e->buf = p;
+        *e->cap = ncap;
+    }
+    memmove(*e->buf + e->pos + n, *e->buf + e->pos, e->len - e->pos);
+    memcpy(*e->buf + e->pos, s, n);
+    e->len += n;
+    e->pos += n;
+    return 0;
+}
+
+static void edit_delete(struct edit *e, size_t from, size_t to) {
+    memmove(*e->buf + from, *e->buf + to, e->len - to);
+    e->len -= to - from;
+    e->pos = from;
+}
+
+// Bytes that must be escaped to stay part of a filled-in word.
+static int needs_escape(char c) { return c && strchr(" \t'\"\\|&;<>*?[$#", c) != NULL; }
+
+// Complete the word before the cursor.
+static void edit_complete(struct edit *e, int listing_ok) {
+    char *line = *e->buf;
+    size_t start = e->pos;
+    while (start > 0 && !strchr(" \t|&;<>", line[start-1])) start--; // Escaped spaces are not handled
+    size_t before = start;
+    while (before > 0 && (line[before-1] == ' ' || line[before-1] == '\t')) before--;
+    int command = before == 0 || strchr("|&;", line[before-1]);
+    const char *word = line + start;
+    size_t wlen = e->pos - start;
+
+    struct compl c = { NULL, 0, 0, wlen };
+    if (command && !memchr(word, '/', wlen)) compl_commands(&c, word, wlen);
+    else compl_files(&c, word, wlen);
+    if (c.n == 0) { ssize_t r = write(STDOUT_FILENO, "\a", 1); (void)r; goto out; }
+    qsort(c.v, c.n, sizeof *c.v, str_cmp);
+    size_t u = 1; // A builtin that is also in $PATH (echo, test ...) comes once
+    for (size_t i = 1; i < c.n; i++) {
+        if (strcmp(c.v[i], c.v[u-1]) == 0) free(c.v[i]);
+        else c.v[u++] = c.v[i];
+    }
+    c.n = u;
+
+    size_t common = strlen(c.v[0]); // Longest prefix shared by all matches
+    for (size_t i = 1; i < c.n; i++) {
+        size_t k = 0;
+        while (k < common && c.v[i][k] == c.v[0][k]) k++;
+        common = k;
+    }
+    if (common > c.typed || c.n == 1) {
+        for (size_t k = c.typed; k < common; k++) {
+            if (needs_escape(c.v[0][k])) edit_insert(e, "\\", 1);
+            edit_insert(e, &c.v[0][k], 1);
+        }
+        if (c.n == 1 && c.v[0][common-1] != '/') edit_insert(e, " ", 1);
+    } else if (!listing_ok) {
+        ssize_t r = write(STDOUT_FILENO, "\a", 1); // Press Tab again for the list
+        (void)r;
+    } else {
+        size_t width = 0;
+        for (size_t i = 0; i < c.n; i++) if (strlen(c.v[i]) > width) width = strlen(c.v[i]);
+        width += 2;
+        size_t cols = width < 80 ? 80 / width : 1;
+        printf("\n");
+        for (size_t i = 0; i < c.n && i < COMPL_LIST_MAX; i++)
+            printf("%-*s%s", (int)width, c.v[i], (i + 1) % cols == 0 || i + 1 == c.n || i + 1 == COMPL_LIST_MAX ? "\n" : "");
+        if (c.n > COMPL_LIST_MAX) printf("... and %zu more\n", c.n - COMPL_LIST_MAX);
+        fflush(stdout);
+    }
+    edit_refresh(e);
+out:
+    for (size_t i = 0; i < c.n; i++) free(c.v[i]);
+    free(c.v);
+}
+
+// Read one line from the terminal with editing. Like getline() it returns
+// the line's length, or -1 at EOF; the line has no trailing '\n'.
+static ssize_t edit_line(const char *prompt, char **buf, size_t *cap) {
+    struct termios saved, raw;
+    if (tcgetattr(STDIN_FILENO, &saved) < 0) return -1;
+    raw = saved;
+    raw.c_iflag &= ~(tcflag_t)(ICRNL | IXON);
+    raw.c_lflag &= ~(tcflag_t)(ICANON | ECHO | ISIG | IEXTEN); // Ctrl-C arrives as a key
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    struct edit e = { buf, cap, 0, 0, prompt };
+    ssize_t ret = -1;
+    int last_tab = 0;
+    if (edit_insert(&e, "", 0) < 0) goto done; // Make sure there is a buffer
+    fflush(stdout);
+    edit_refresh(&e);
+    for (;;) {
+        char c;
+        uint64_t next; // Background `timeout`s keep running while we wait for a key
+        while ((next = timeouts_fire()) && !wait_event(STDIN_FILENO, next)) reap_children();
+        ssize_t r = read(STDIN_FILENO, &c, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        int tab = c == '\t';
+        char *line = *e.buf;
+        switch (c) {
+        case '\r': case '\n':
+            ret = (ssize_t)e.len;
+            goto done;
+        case 4: // Ctrl-D
+            if (e.len == 0) goto done;
+            if (e.pos < e.len) edit_delete(&e, e.pos, e.pos + 1);
+            break;
+        case 3: // Ctrl-C
+            printf("^C\n");
+            fflush(stdout);
+            e.len = e.pos = 0;
+            break;
+        case '\t': edit_complete(&e, last_tab); break;
+        case 127: case 8: if (e.pos > 0) edit_delete(&e, e.pos - 1, e.pos); break;
+        case 1: e.pos = 0; break;                  // Ctrl-A
+        case 5: e.pos = e.len; break;              // Ctrl-E
+        case 2: if (e.pos > 0) e.pos--; break;     // Ctrl-B
+        case 6: if (e.pos < e.len) e.pos++; break; // Ctrl-F
+        case 11: e.len = e.pos; break;             // Ctrl-K
+        case 21: edit_delete(&e, 0, e.pos); break; // Ctrl-U
+        case 23: { // Ctrl-W: the word before the cursor
+            size_t p = e.pos;
+            while (p > 0 && line[p-1] == ' ') p--;
+            while (p > 0 && line[p-1] != ' ') p--;
+            edit_delete(&e, p, e.pos);
+            break;
+        }
+        case 12: { ssize_t w = write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7); (void)w; break; } // Ctrl-L
+        case 27: { // Escape sequences: arrows, Home, End, Delete
+            char seq[3];
+            if (read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1) break;
+            if (seq[0] != '[' && seq[0] != 'O') break;
+            if (seq[1] >= '0' && seq[1] <= '9') {
+                if (read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~') break;
+                if (seq[1] == '3' && e.pos < e.len) edit_delete(&e, e.pos, e.pos + 1);
+                if (seq[1] == '1' || seq[1] == '7') e.pos = 0;
+                if (seq[1] == '4' || seq[1] == '8') e.pos = e.len;
+                break;
+            }
+            if (seq[1] == 'C' && e.pos < e.len) e.pos++;
+            if (seq[1] == 'D' && e.pos > 0) e.pos--;
+            if (seq[1] == 'H') e.pos = 0;
+            if (seq[1] == 'F') e.pos = e.len;
+            break;
+        }
+        default:
+            if ((unsigned char)c >= 32 && edit_insert(&e, &c, 1) < 0) goto done;
+            break;
+        }
+        last_tab = tab;
+        if (!tab) edit_refresh(&e);
+    }
+done:
+    if (*e.buf) (*e.buf)[e.len] = '\0';
+    if (ret >= 0) { ssize_t w = write(STDOUT_FILENO, "\n", 1); (void)w; } // At EOF repl() does that
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    return ret;
+}
+
+// ------------------ The read-eval loop ------------------
+// Reads commands until EOF: from the terminal with a prompt when interactive,
+// else from `in` (scripts, -c strings and pipes), simply line by line.
+static void repl(struct reader *in, int interactive) {
+    char *line;
+    if (interactive) in->prompt = "> "; // Old-school prompt, just one character
+
+    // Infinite loop to read commands 
+    for (;;) {
+        // Collect background jobs that finished, and announce them
+        reap_children();
+        notify_jobs(interactive);
+
+        // ------------------ Read input ------------------
+        line_seq++;
+        uint64_t t0 = now_ns();
+        size_t len;
+        line = reader_line(in, &len); // In place, or typed at the prompt, see "Reading scripts"
+        if (!line) { if (interactive) putchar('\n'); break; } // EOF/Ctrl-D exits the infinite loop and ends the shell
+        lat_add(&phases[PH_READ], now_ns() - t0); // At a prompt that includes the typing
+        if (line[0] == '\0') continue;      // Ignore empty lines, skip to next iteration
+        if (interactive) hist_add(line, len); // Before tokenize() cuts it up
+
+        // Everything allocated for the previous line goes away in one step.
+        arena_reset(&arena);
+
+        // ------------------ Parse input ------------------
+        struct cmd_list list;
+        uint64_t t1 = now_ns();
+        int r = parse_line(line, len, &list, in); // see parse_line() above
+        lat_add(&phases[PH_PARSE], now_ns() - t1);
+        if (r < 0) { last_status = 2; if (sc_rec) sc_rec->bad = 1; continue; } // Syntax error, already reported
+        if (r == 0) continue; // Only whitespace or a comment
+        if (sc_rec) sc_record(sc_rec, &list); // For the next run, see "Compiled scripts"
+
+        // ------------------ Run it ------------------
+        last_status = eval_list(&list); // Builtins run right here, see eval_pipeline()
+        if (exit_requested) break; // `exit` ends the loop
+    }
+
+    cleanup(); // Free the arena before exiting; the line buffer goes with the reader
+    // Note: main() closes the reader, which frees the buffer getline() or
+    // edit_line() allocated for terminal input.
+    // This is a simple shell, so we don't need to handle memory leaks or other cleanup
+    // in a complex way. The OS will reclaim all memory used by the process when it exits. 
+}
+
+// ------------------ Command server: mtsh --serve SOCK, mtsh --client SOCK cmd ------------------
+// Starting a shell costs an exec, dynamic linking and our own setup before the
+// first command even runs. A server pays that once: it listens on a Unix
+// socket, and each client hands it a command line together with its own
+// stdin, stdout and stderr (as SCM_RIGHTS ancillary data), so the commands
+// read and write the client's files and terminals directly. The reply is the
+// exit status.
+//
+// The server parses each line itself and looks its commands up in its PATH
+// cache, so the cache gets warm and stays warm. Then it forks a copy of itself
+// to run the line, and goes back to accept() at once: clients run
+// concurrently, and a `cd` or `exit` in one request does not affect the
+// server or other requests. Who may connect is decided by the socket file's
+// permissions, like for any Unix socket.
+//
+// Wire format, client to server: a uint32_t length (with the 3 fds attached),
+// then that many bytes of command line. Server to client: an int32_t status.
+#define SERVE_MAX_LINE (1024 * 1024) // Longest command line a client may send
+
+static int unix_socket(const char *path, struct sockaddr_un *sa) {
+    memset(sa, 0, sizeof *sa);
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof sa->sun_path) {
+        fprintf(stderr, "mtsh: %s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(sa->sun_path, path);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0) { perror("mtsh: socket"); return -1; }
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    return s;
+}
+
+// Receive one request: the three fds, and the command line into *bufp (grown
+// as needed) with its length in *lenp.
+static int recv_request(int c, int fds[3], char **bufp, size_t *capp, size_t *lenp) {
+    uint32_t len;
+    int nfds = recv_fds(c, &len, sizeof len, fds, 3);
+    if (nfds < 0) return -1;
+    if (nfds < 3 || len > SERVE_MAX_LINE) goto bad;
+    if (len + 1 > *capp) {
+        char *p = realloc(*bufp, len + 1);
+        if (!p) goto bad;
+        *bufp = p;
+        *capp = len + 1;
+    }
+    if (read_all(c, *bufp, len) < 0) goto bad;
+    (*bufp)[len] = '\0';
+    *lenp = len;
+    return 0;
+bad:
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+    return -1;
+}
+
+// Look up every command of a parsed line now, in the server, so the cache
+// the request's process inherits already has them (and keeps them for next time).
+static void warm_path_cache(const struct cmd_list *list) {
+    for (int k = 0; k < list->ncmds; k++)
+        for (int p = 0; p < list->cmds[k].npipes; p++)
+            for (int s = 0; s < list->cmds[k].pipes[p].nstages; s++) {
+                char **argv = list->cmds[k].pipes[p].stages[s].argv;
+                const char *name = argv[0] && strcmp(argv[0], "time") == 0 ? argv[1] : argv[0];
+                if (name && !strchr(name, '/') && !strchr(name, '$') && !find_builtin(name))
+                    path_lookup(name);
+            }
+}
+
+// Handle one connection: run its line with the client's fds as 0, 1 and 2.
+static void serve_one(int c, char **bufp, size_t *capp) {
+    int fds[3];
+    size_t len;
+    if (recv_request(c, fds, bufp, capp, &len) < 0) return;
+
+    // Switch our own 0/1/2 to the client's while parsing (so syntax errors go
+    // to the client) and forking; the server gets its own back right after.
+    struct saved_fd save[3];
+    int nsaved = 0;
+    struct redir rd[3];
+    for (int i = 0; i < 3; i++) rd[i] = (struct redir){ i, R_DUP, fds[i], NULL };
+    fflush(stdout);
+    if (apply_redirs(rd, 3, save, &nsaved) == 0) {
+        arena_reset(&arena);
+        struct cmd_list list;
+        int r = parse_line(*bufp, len, &list, NULL);
+        int32_t status = r < 0 ? 2 : 0; // Syntax error, or nothing to do
+        if (r > 0) {
+            warm_path_cache(&list);
+            pid_t pid = fork();
+            n_forked += pid > 0; // For `stats`
+            if (pid == 0) { // The request's process
+                zygote_detach();
+                exec_log_forked();
+                timeouts_forked();
+                threads_forked();
+                status = eval_list(&list);
+                fflush(stdout);
+                exec_log_flush();
+                send(c, &status, sizeof status, MSG_NOSIGNAL);
+                _exit(status);
+            }
+            if (pid < 0) { perror("fork"); status = 1; }
+        }
+        if (r <= 0 || status != 0) send(c, &status, sizeof status, MSG_NOSIGNAL); // Else the child replies
+    }
+    restore_redirs(save, nsaved);
+    for (int i = 0; i < 3; i++) close(fds[i]);
+}
+
+static int serve(const char *path) {
+    struct sockaddr_un sa;
+    int ls = unix_socket(path, &sa);
+    if (ls < 0) return 2;
+    unlink(path); // A socket left behind by an earlier server
+    if (bind(ls, (struct sockaddr *)&sa, sizeof sa) < 0 || listen(ls, SOMAXCONN) < 0) {
+        fprintf(stderr, "mtsh: %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+    char *buf = NULL;
+    size_t cap = 0;
+    for (;;) {
+        reap_children(); // Finished requests
+        int c = accept(ls, NULL, NULL);
+        if (c < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("mtsh: accept");
+            break;
+        }
+        fcntl(c, F_SETFD, FD_CLOEXEC);
+        serve_one(c, &buf, &cap);
+        close(c);
+    }
+    free(buf);
+    close(ls);
+    return 1;
+}
+
+// Send argv and our 0/1/2 to a server, and return the status it reports.
+// The server reads a command line, so each word is single-quoted (' as '\'')
+// unless it is made of bytes that mean nothing to the shell: `echo 'a;b'`
+// stays one command with one argument. `-c LINE` sends LINE as it is.
+static int client(const char *path, char *argv[]) {
+    static const char safe[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_./:,+-@%^";
+    int raw = argv[0] && strcmp(argv[0], "-c") == 0;
+    if (raw && (!argv[1] || argv[2])) { fprintf(stderr, "usage: mtsh --client SOCKET -c 'command line'\n"); return 2; }
+    size_t len = 1;
+    for (int i = raw; argv[i]; i++) len += 4 * strlen(argv[i]) + 3; // Every byte could be a '
+    char *line = malloc(len), *p = line;
+    if (!line) { perror("mtsh"); return 1; }
+    for (int i = raw; argv[i]; i++) {
+        const char *w = argv[i];
+        if (i > raw) *p++ = ' ';
+        if (raw || (*w && !w[strspn(w, safe)])) { p = stpcpy(p, w); continue; }
+        *p++ = '\'';
+        for (; *w; w++) {
+            if (*w == '\'') p = stpcpy(p, "'\\''");
+            else *p++ = *w;
+        }
+        *p++ = '\'';
+    }
+    *p = '\0';
+    uint32_t n = (uint32_t)(p - line);
+
+    struct sockaddr_un sa;
+    int s = unix_socket(path, &sa);
+    if (s < 0) { free(line); return 1; }
+    if (connect(s, (struct sockaddr *)&sa, sizeof sa) < 0) {
+        fprintf(stderr, "mtsh: %s: %s\n", path, strerror(errno));
+        free(line);
+        return 1;
+    }
+
+    const int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int32_t status = 1;
+    if (send_fds(s, &n, sizeof n, fds, 3) < 0 || write_all(s, line, n) < 0) perror("mtsh: send");
+    else if (read_all(s, &status, sizeof status) < 0) {
+        fprintf(stderr, "mtsh: %s: server closed the connection\n", path);
+        status = 1;
+    }
+    free(line);
+    close(s);
+    return status;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: mtsh [--zygote] [--exec-log=FILE] [script [args...]]\n"
+                    "       mtsh [--zygote] [--exec-log=FILE] -c 'command line'\n"
+                    "       mtsh [--exec-log=FILE] --serve SOCKET\n"
+                    "       mtsh --client SOCKET command [args...]\n"
+                    "       mtsh --client SOCKET -c 'command line'\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    // ------------------ Where do commands come from? ------------------
+    //   mtsh               interactive if stdin is a terminal, else batch from stdin
+    //   mtsh script.sh     batch, read the script file
+    //   mtsh -c 'cmd'      batch, run the given command line(s)
+    //   mtsh --serve SOCK  command server, see serve()
+    //   mtsh --client SOCK cmd ...  run cmd in that server (-c 'line': a whole command line)
+    // --zygote in front of the first three starts commands through a helper process.
+    // --exec-log=FILE appends a JSON line per process to FILE, see "Execution log".
+    vars_init(); // The environment becomes our variables
+    cwd_init();  // And $PWD our current directory, if it is right
+    struct reader in;   // Batch input, see "Reading scripts"
+    int script_fd = -1;
+    const char *script = NULL; // Scripts are compiled and cached, see sc_run()
+    int use_zygote = 0;
+    for (; argc > 1; argv++, argc--) {
+        if (strcmp(argv[1], "--zygote") == 0) use_zygote = 1;
+        else if (strncmp(argv[1], "--exec-log=", 11) == 0) { if (exec_log_open(argv[1] + 11) < 0) return 2; }
+        else break;
+    }
+    if (argc > 1 && (strcmp(argv[1], "--serve") == 0 || strcmp(argv[1], "--client") == 0)) {
+        if (argc < 3 || (argv[1][2] == 'c' && argc < 4)) usage();
+        if (argv[1][2] == 'c') return client(argv[2], &argv[3]);
+        setvbuf(stdout, NULL, _IOFBF, IO_BUFSIZE);
+        jobs_init(); // No zygote here: requests run in forks, which spawn directly
+        return serve(argv[2]);
+    } else if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) { fprintf(stderr, "mtsh: -c: option requires an argument\n"); usage(); }
+        reader_string(&in, argv[2]); // Read the string like a file
+    } else if (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+        usage();
+    } else if (argc > 1) {
+        script_fd = open(script = argv[1], O_RDONLY | O_CLOEXEC);
+        if (script_fd < 0) { fprintf(stderr, "mtsh: %s: %s\n", argv[1], strerror(errno)); return 127; }
+        reader_open(&in, script_fd);
+    } else {
+        reader_open(&in, STDIN_FILENO);
+    }
+    int interactive = in.fd == STDIN_FILENO && isatty(STDIN_FILENO);
+
+    if (interactive) {
+        // You can delete or comment out this part if you don't want the banner.
+        printf("                      _             _          _ _ \n");
+        printf("  ___ _ __ ___  _ __ | |_ _   _ ___| |__   ___| | |\n");
+        printf(" / _ \\ '_ ` _ \\| '_ \\| __| | | / __| '_ \\ / _ \\ | |\n");
+        printf("|  __/ | | | | | |_) | |_| |_| \\__ \\ | | |  __/ | |\n");
+        printf(" \\___|_| |_| |_| .__/ \\__|\\__, |___/_| |_|\\___|_|_|\n");
+        printf("               |_|        |___/                    \n");
+        printf(" emptyshell — Minimal Teaching Shell v0.2.0\n");
+        printf(" POSIX.1-2008 • Simple • Hackable\n");
+        printf("-----------------------------------------------------\n\n");
+    } else {
+        // Batch mode: no banner, no prompt. Read the input (see reader_line()) and
+        // write stdout in big blocks instead of paying a read()/write() (or a
+        // flush) per line. stdout is flushed before each command we start, see
+        // run_pipeline().
+        setvbuf(stdout, NULL, _IOFBF, IO_BUFSIZE);
+    }
+
+    if (use_zygote) zygote_start(); // Before jobs_init(): the helper keeps default signal handling
+    jobs_init();
+    if (!script || !sc_run(script, script_fd)) {
+        repl(&in, interactive);
+        if (sc_rec) sc_save(script, &in); // Compiled for next time
+    }
+    reader_close(&in);
+    if (script_fd >= 0) close(script_fd);
+    return last_status;
+}